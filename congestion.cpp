@@ -0,0 +1,143 @@
+//
+//        congestion.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "congestion.h"
+#include <cmath>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+CongestionControl::CongestionControl(WriteHelper *helper)
+    : helper(helper), refilled(Clock::now())
+{
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     room
+//
+//    bytes that may be sent now, given inFlight bytes unacked: what
+//    is left of the window, and no more than the pacer has built up.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+size_t CongestionControl::room(size_t inFlight)
+{
+    Clock::time_point now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - refilled).count();
+    refilled = now;
+
+    // A big window may leave a bigger burst, or the pacer would cap it.
+    double burst = max(PACING_BURST, cwnd / 4);
+    tokens = min(tokens + pacingRate() * elapsed, burst);
+
+    if (inFlight >= cwnd || tokens <= 0)
+        return 0;
+    return min(cwnd - inFlight, size_t(ceil(tokens)));
+}
+
+// a packet of this many bytes just went out: data, or parity that's no use if it's lost
+void CongestionControl::sent(size_t bytes, bool data)
+{
+    tokens -= bytes;
+    bytesSent += bytes;
+    if (!data)
+        return;
+
+    recentSent++;
+    if (recentSent > LOSS_HISTORY)
+    {
+        recentSent /= 2;
+        recentLost /= 2;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     acked / lost
+//
+//    the additive increase and multiplicative decrease.
+//    See congestion.h for how big the decrease is.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void CongestionControl::acked(size_t bytes, unsigned int payload)
+{
+    bytesAcked += bytes;
+    if (cwnd < ssthresh)
+        cwnd += bytes;
+    else
+        cwnd += max(size_t(1), size_t(payload) * bytes / cwnd);
+    cwnd = min(cwnd, MAX_CWND);
+}
+
+void CongestionControl::lost(unsigned int packets)
+{
+    packetsLost += packets;
+
+    // Everything lost in the same RTT is one congestion event.
+    Clock::time_point now = Clock::now();
+    if (lossEvents > 0 && now - lastDecrease < helper->rtt())
+        return;
+
+    lastDecrease = now;
+    lossEvents++;
+
+    double queued = cwnd * (1 - std::chrono::duration<double>(helper->minRtt()).count() /
+                                    std::chrono::duration<double>(helper->rtt()).count());
+    if (queued < RANDOM_LOSS_BACKLOG)
+        cwnd = cwnd * 4 / 5;
+    else
+        cwnd = cwnd / 2;
+    cwnd = max(MIN_CWND, cwnd);
+    ssthresh = cwnd;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     dataLost / lossRate
+//
+//    data packets the server says it only got on a later send or
+//    from parity, and the share of recent ones that were.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void CongestionControl::dataLost(unsigned int packets)
+{
+    recentLost += packets;
+}
+
+double CongestionControl::lossRate()
+{
+    return recentSent > 0 ? min(1.0, recentLost / recentSent) : 0;
+}
+
+size_t CongestionControl::window()
+{
+    return cwnd;
+}
+
+double CongestionControl::pacingRate()
+{
+    double gain = cwnd < ssthresh ? SLOW_START_GAIN : STEADY_GAIN;
+    return gain * cwnd / std::chrono::duration<double>(helper->rtt()).count();
+}
+
+unsigned long CongestionControl::sentBytes()
+{
+    return bytesSent;
+}
+
+unsigned long CongestionControl::ackedBytes()
+{
+    return bytesAcked;
+}
+
+unsigned long CongestionControl::lostPackets()
+{
+    return packetsLost;
+}
+
+unsigned int CongestionControl::losses()
+{
+    return lossEvents;
+}
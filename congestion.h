@@ -0,0 +1,92 @@
+//
+//        congestion.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include "filehelper.h"
+
+// Bytes of data packets allowed in flight, across all files, at the start and
+// at most and least. The window grows and shrinks between these as we go.
+// It never goes below what a server's default socket buffer is known to take,
+// or the random drops of a nasty network would keep it pinned at the bottom.
+const size_t INITIAL_CWND = 128000;
+const size_t MIN_CWND = 128000;
+const size_t MAX_CWND = 4000000;
+
+// How much faster than cwnd per RTT packets are paced out, while the window is
+// still doubling and once it has settled. A little over 1 keeps the window full.
+const double SLOW_START_GAIN = 2.0;
+const double STEADY_GAIN = 1.25;
+
+// Most bytes the pacer lets go out back to back after a quiet spell.
+const size_t PACING_BURST = 32000;
+
+// Bytes we may have queued on the path, by our RTT estimate, before a loss is
+// blamed on congestion rather than on the network just dropping packets.
+const size_t RANDOM_LOSS_BACKLOG = 24000;
+
+// Packets the loss rate is measured over. Older ones count for less and less.
+const double LOSS_HISTORY = 2048;
+
+// AIMD congestion control for the data packets of every file the client has
+// in flight, since they all share one path to one server loop.
+//
+// The window starts in slow start, growing by every byte acked, until the
+// first loss. From then on it grows by about one packet per window's worth
+// acked, and shrinks on a loss, at most once per RTT so one burst of drops
+// only counts once. Losses are data packets that time out, and packets a
+// server's 'e' check reports missing.
+//
+// As in TCP Veno, how much it shrinks depends on how much of the window is
+// sitting in queues, cwnd * (1 - minRTT / SRTT). A loss with a backlog is
+// congestion and halves the window. Without one the network just dropped it,
+// as nastiness does, and the window only loses a fifth.
+//
+// Sends are also paced: a token bucket filled at gain * cwnd / SRTT keeps a
+// whole window from leaving in one burst and overflowing the server's socket.
+//
+// It also keeps the recent loss rate, for forward error correction. That is
+// the share of data packets whose first send the server says it never got,
+// whether they were sent again or rebuilt from parity. Timeouts alone would
+// count lost acks as well, and parity can't help with those.
+class CongestionControl
+{
+private:
+    WriteHelper *helper; // for the smoothed RTT
+    size_t cwnd = INITIAL_CWND;
+    size_t ssthresh = MAX_CWND;
+    double tokens = PACING_BURST;
+    Clock::time_point refilled;
+    Clock::time_point lastDecrease;
+
+    unsigned long bytesSent = 0;
+    unsigned long bytesAcked = 0;
+    unsigned long packetsLost = 0;
+    unsigned int lossEvents = 0;
+    double recentSent = 0; // both decay, so the rate follows the recent past
+    double recentLost = 0;
+
+public:
+    CongestionControl(WriteHelper *helper);
+
+    size_t room(size_t inFlight);
+    void sent(size_t bytes, bool data = true);
+    void acked(size_t bytes, unsigned int payload);
+    void lost(unsigned int packets);
+    void dataLost(unsigned int packets);
+    double lossRate();
+
+    // stats
+    size_t window();
+    double pacingRate(); // bytes per second
+    unsigned long sentBytes();
+    unsigned long ackedBytes();
+    unsigned long lostPackets();
+    unsigned int losses();
+};
+
+#endif
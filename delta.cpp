@@ -0,0 +1,289 @@
+//
+//        delta.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "delta.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+// Bytes of our file planDelta reads at a time, on top of one window.
+const size_t DELTA_CHUNK = 1 << 20;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     RollingChecksum
+//
+//    a is the sum of the bytes, and b the sum of each byte times its
+//    distance from the end, which is also the sum of a as it goes.
+//    Only the low 16 bits of each are used.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void RollingChecksum::init(const char *data, size_t len)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    unsigned int sumA = 0;
+    unsigned int sumB = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        sumA += bytes[i];
+        sumB += sumA;
+    }
+    this->len = len;
+    a = sumA;
+    b = sumB;
+}
+
+// moves the window one byte on: out leaves the front, in joins the back
+void RollingChecksum::roll(unsigned char out, unsigned char in)
+{
+    a += in - out;
+    b += a - len * out;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     pieceSignatures
+//
+//    the Signature of every whole payload sized piece in bytes.
+//    A short piece at the end of the file gets none.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void pieceSignatures(const char *data, size_t bytes, unsigned int payload, Signature *out)
+{
+    for (size_t offset = 0; offset + payload <= bytes; offset += payload)
+    {
+        RollingChecksum sum;
+        sum.init(data + offset, payload);
+        out->weak = sum.value();
+        out->strong = crc32c(data + offset, payload);
+        out++;
+    }
+}
+
+// A run of our file that matches a run of the server's old copy.
+struct Match
+{
+    size_t start; // in our file
+    size_t base;  // in the old copy
+    size_t len;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     planDelta
+//
+//    finds the packets of our file the server can copy from its old
+//    copy. copyFrom gets, for each packet, where its bytes start in
+//    the old copy, or NO_COPY. Returns how many packets have a copy.
+//
+//    The window slides a byte at a time until it matches a piece,
+//    then jumps a whole piece. Most windows match no weak checksum,
+//    which a table of the low 16 bits of each rules out quickly, and
+//    in a file that mostly hasn't changed most are the next piece.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int planDelta(FileReader *reader, const vector<Signature> &signatures, unsigned int payload, vector<uint64_t> &copyFrom)
+{
+    size_t size = reader->size();
+    copyFrom.assign((size + payload - 1) / payload, NO_COPY);
+    if (signatures.empty() || size < payload)
+        return 0;
+
+    // Pieces sorted by weak checksum, so all the pieces a window might be are together.
+    vector<pair<unsigned int, unsigned int>> byWeak;
+    vector<bool> seen(1 << 16, false);
+    for (unsigned int i = 0; i < signatures.size(); i++)
+    {
+        byWeak.push_back(make_pair(signatures[i].weak, i));
+        seen[signatures[i].weak & 0xffff] = true;
+    }
+    sort(byWeak.begin(), byWeak.end());
+
+    vector<Match> matches;
+    vector<char> buffer(DELTA_CHUNK + payload);
+    size_t x = 0; // where the window starts in our file
+
+    while (x + payload <= size)
+    {
+        size_t chunkStart = x;
+        size_t chunkLen = min(DELTA_CHUNK + payload, size - chunkStart);
+        const char *data = reader->read(chunkStart, chunkLen, buffer.data());
+        size_t last = chunkStart + chunkLen - payload; // last window start inside the chunk
+
+        RollingChecksum sum;
+        bool fresh = true;
+        while (x <= last)
+        {
+            const char *window = data + (x - chunkStart);
+
+            // Right after a match the window is most likely the piece after it,
+            // and its CRC alone is enough to tell, without summing the window.
+            if (fresh && !matches.empty() && matches.back().start + matches.back().len == x)
+            {
+                size_t next = (matches.back().base + matches.back().len) / payload;
+                if (next < signatures.size() && signatures[next].strong == crc32c(window, payload))
+                {
+                    matches.back().len += payload;
+                    x += payload;
+                    continue;
+                }
+            }
+
+            if (fresh)
+            {
+                sum.init(window, payload);
+                fresh = false;
+            }
+
+            unsigned int weak = sum.value();
+            long piece = -1;
+            if (seen[weak & 0xffff])
+            {
+                vector<pair<unsigned int, unsigned int>>::iterator it =
+                    lower_bound(byWeak.begin(), byWeak.end(), make_pair(weak, 0u));
+                unsigned int strong = 0;
+                bool hashed = false;
+                for (; it != byWeak.end() && it->first == weak; it++)
+                {
+                    if (!hashed)
+                    {
+                        strong = crc32c(window, payload);
+                        hashed = true;
+                    }
+                    // Any piece with these bytes will do. The one after the last
+                    // match was tried above, so there's no run to keep whole, and
+                    // looking further would cost every window of a file with many
+                    // identical pieces (zeros, say) a pass over all of them.
+                    if (signatures[it->second].strong == strong)
+                    {
+                        piece = it->second;
+                        break;
+                    }
+                }
+            }
+
+            if (piece >= 0)
+            {
+                size_t base = size_t(piece) * payload;
+                if (!matches.empty() && matches.back().start + matches.back().len == x &&
+                    matches.back().base + matches.back().len == base)
+                    matches.back().len += payload;
+                else
+                    matches.push_back({x, base, payload});
+                x += payload;
+                fresh = true;
+                continue;
+            }
+
+            if (x == last)
+            {
+                x++;
+                break;
+            }
+            sum.roll(window[0], window[payload]);
+            x++;
+        }
+    }
+
+    // A packet can be copied if all of its bytes are in one match.
+    unsigned int copies = 0;
+    for (unsigned int m = 0; m < matches.size(); m++)
+    {
+        size_t end = matches[m].start + matches[m].len;
+        for (size_t p = (matches[m].start + payload - 1) / payload; p < copyFrom.size(); p++)
+        {
+            size_t start = p * payload;
+            if (start + min(size_t(payload), size - start) > end)
+                break;
+            copyFrom[p] = matches[m].base + (start - matches[m].start);
+            copies++;
+        }
+    }
+    return copies;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     SignatureFetch
+//
+//        sets up to fetch the signatures of pieces 0 .. pieces - 1.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+SignatureFetch::SignatureFetch(unsigned int fileId, unsigned int pieces)
+    : fileId(fileId), found(pieces)
+{
+}
+
+bool SignatureFetch::done()
+{
+    return next == found.size() && pending.empty();
+}
+
+const vector<Signature> &SignatureFetch::signatures()
+{
+    return found;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     pump
+//
+//    sends new queries until SIGNATURE_WINDOW are out, and any
+//    whose response is overdue. The server reads its old copy for
+//    every one, so each resend of a query waits twice as long.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void SignatureFetch::pump(C150NastyDgmSocket *sock, WriteHelper *helper)
+{
+    Clock::time_point now = Clock::now();
+    while (pending.size() < SIGNATURE_WINDOW && next < found.size())
+    {
+        SignatureQuery query;
+        query.first = next;
+        query.count = min(SIGNATURE_BATCH, (unsigned int)found.size() - next);
+        pending.push_back(query); // sentAt starts at the epoch, so it goes out below
+        next += query.count;
+    }
+
+    for (unsigned int i = 0; i < pending.size(); i++)
+    {
+        if (now - pending[i].sentAt < helper->rto(pending[i].resends))
+            continue;
+
+        SignaturePacket pckt;
+        pckt.cmd = 'g';
+        pckt.fileId = fileId;
+        pckt.first = pending[i].first;
+        pckt.count = pending[i].count;
+        helper->sendMsg(sock, pckt);
+        if (pending[i].sentAt != Clock::time_point())
+            pending[i].resends++;
+        pending[i].sentAt = now;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     handle
+//
+//    stores the signatures in a response. false if it isn't
+//    for a query we're waiting on.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool SignatureFetch::handle(const SignatureResponsePacket &response)
+{
+    for (unsigned int i = 0; i < pending.size(); i++)
+    {
+        if (response.fileId != fileId || response.first != pending[i].first || response.count != pending[i].count)
+            continue;
+
+        memcpy(&found[response.first], response.signatures, response.count * sizeof(Signature));
+        pending.erase(pending.begin() + i);
+        return true;
+    }
+    return false;
+}
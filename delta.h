@@ -0,0 +1,74 @@
+//
+//        delta.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "filehelper.h"
+#include "filereader.h"
+
+// When the server already has a copy of a file, the client sends only what
+// changed, as rsync does. The server's old copy is cut into payload sized
+// pieces, and the client asks for a Signature of each with 'g' queries.
+// It then slides a window over its own file a byte at a time, and wherever
+// the window matches a piece, those bytes are already on the server. Packets
+// whose bytes all match one run of the old copy go as a 'd' copy instead of
+// as data. Everything else, and anything a check finds wrong, goes as data.
+//
+// A match only needs the RollingChecksum and CRC-32C to agree, so now and
+// then it can be wrong. The 'e' checks catch that like any other bad packet.
+
+// A packet that isn't in the server's old copy.
+const uint64_t NO_COPY = ~uint64_t(0);
+
+// Most 'g' queries out at once.
+const unsigned int SIGNATURE_WINDOW = 16;
+
+// rsync's rolling checksum of a window of bytes, which slides along
+// one byte at a time without looking at the rest of the window.
+struct RollingChecksum
+{
+    unsigned int a = 0;
+    unsigned int b = 0;
+    size_t len = 0;
+
+    void init(const char *data, size_t len);
+    void roll(unsigned char out, unsigned char in);
+    unsigned int value() const { return (a & 0xffff) | (b << 16); }
+};
+
+void pieceSignatures(const char *data, size_t bytes, unsigned int payload, Signature *out);
+unsigned int planDelta(FileReader *reader, const vector<Signature> &signatures, unsigned int payload, vector<uint64_t> &copyFrom);
+
+// One 'g' query waiting for its response.
+struct SignatureQuery
+{
+    unsigned int first;
+    unsigned int count;
+    Clock::time_point sentAt;
+    unsigned int resends = 0;
+};
+
+// Fetches every Signature of the server's old copy of a file, keeping
+// up to SIGNATURE_WINDOW queries out and resending any that are overdue.
+class SignatureFetch
+{
+private:
+    unsigned int fileId;
+    vector<Signature> found;
+    vector<SignatureQuery> pending;
+    unsigned int next = 0; // first piece not yet asked for
+
+public:
+    SignatureFetch(unsigned int fileId, unsigned int pieces);
+
+    bool done();
+    const vector<Signature> &signatures();
+    void pump(C150NastyDgmSocket *sock, WriteHelper *helper);
+    bool handle(const SignatureResponsePacket &response);
+};
+
+#endif
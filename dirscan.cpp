@@ -0,0 +1,117 @@
+//
+//        dirscan.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "dirscan.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <thread>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+DirScanner::DirScanner(string root)
+    : root(root)
+{
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     scan
+//
+//    every regular file under root, in no particular order. The
+//    scan is done once no directory is waiting and no thread is
+//    still listing one that might turn up more.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+vector<ScannedFile> DirScanner::scan(unsigned int threads)
+{
+    dirs.assign(1, "");
+    found.clear();
+
+    vector<thread> pool;
+    for (unsigned int i = 0; i < max(1u, threads); i++)
+        pool.emplace_back(&DirScanner::work, this);
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+
+    return found;
+}
+
+void DirScanner::work()
+{
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        ready.wait(guard, [this]() { return !dirs.empty() || busy == 0; });
+        if (dirs.empty())
+            return;
+
+        string dir = dirs.front();
+        dirs.pop_front();
+        busy++;
+        guard.unlock();
+
+        vector<ScannedFile> files;
+        vector<string> subdirs;
+        list(dir, files, subdirs);
+
+        guard.lock();
+        found.insert(found.end(), files.begin(), files.end());
+        dirs.insert(dirs.end(), subdirs.begin(), subdirs.end());
+        busy--;
+        ready.notify_all();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     list
+//
+//    the files and directories in dir, named from root. Entries
+//    are stated relative to the open directory, so a deep tree
+//    doesn't cost a full path lookup per file.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void DirScanner::list(const string &dir, vector<ScannedFile> &files, vector<string> &subdirs)
+{
+    string path = dir.empty() ? root : makeFileName(root, dir);
+    DIR *listing = opendir(path.c_str());
+    if (listing == NULL)
+    {
+        cerr << "Error opening directory " << path << " errno=" << strerror(errno) << endl;
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != NULL)
+    {
+        // skip the . and .. names
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        string name = dir.empty() ? string(entry->d_name) : dir + "/" + entry->d_name;
+        struct stat statbuf;
+        if (fstatat(dirfd(listing), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            cerr << "Error stating " << makeFileName(root, name) << " errno=" << strerror(errno) << endl;
+            continue;
+        }
+
+        if (S_ISDIR(statbuf.st_mode))
+            subdirs.push_back(name);
+        else if (!S_ISREG(statbuf.st_mode))
+            continue;
+        else if (name.size() > MAX_NAME)
+            cerr << "Skipping " << name << ": name longer than " << MAX_NAME << " characters" << endl;
+        else
+            files.push_back({name, size_t(statbuf.st_size)});
+    }
+    closedir(listing);
+}
@@ -0,0 +1,55 @@
+//
+//        dirscan.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include "filehelper.h"
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Threads that list directories and stat what's in them at once.
+const unsigned int SCAN_THREADS = 8;
+
+// Longest name, with its directories, a StartPacket can carry.
+const size_t MAX_NAME = sizeof(StartPacket::name) - 1;
+
+// One regular file found under the source directory.
+struct ScannedFile
+{
+    string name; // path from the source directory, '/' between directories
+    size_t size;
+};
+
+// Finds every regular file under a directory, however deep, before any of
+// them is sent, so the scheduler can pick the order.
+//
+// Directories are listed by a pool of threads. Each thread takes the next
+// directory nobody has listed, stats everything in it, and hands back the
+// files it found and the directories to list next. Symlinks and anything
+// else that isn't a plain file or directory are left alone, as are names
+// too long for a StartPacket.
+class DirScanner
+{
+private:
+    string root;
+    mutex lock;
+    condition_variable ready;
+    deque<string> dirs;     // found but not listed yet
+    unsigned int busy = 0;  // threads listing a directory right now
+    vector<ScannedFile> found;
+
+    void work();
+    void list(const string &dir, vector<ScannedFile> &files, vector<string> &subdirs);
+
+public:
+    DirScanner(string root);
+
+    vector<ScannedFile> scan(unsigned int threads = SCAN_THREADS);
+};
+
+#endif
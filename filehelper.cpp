@@ -11,12 +11,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <cstring> // for errno string formatting
+#include <cstddef>
+#include <cstdint>
 #include <cerrno>
 #include <cstring>  // for strerro
 #include <iostream> // for cout
 #include <fstream>
 #include <iomanip>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
 #include "filehelper.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 using namespace C150NETWORK; // for all the comp150 utilities
 
@@ -69,321 +79,547 @@ string makeFileName(string dir, string name)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
-//                     hashFile
+//                     safeName / makeDirectories
 //
-//        creates a hash of a file.
+//        a file's name may have directories in it, but must stay
+//        inside the directory it's relative to: no leading '/', and
+//        no empty, "." or ".." parts. makeDirectories creates the
+//        directories a name is in, under dir, that aren't there yet,
+//        and is false if one of them is already something else.
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-string hashFile(string sourceDir, string fileName, int nastiness)
+bool safeName(const string &name)
 {
+  if (name.empty() || name[0] == '/')
+    return false;
 
-  //
-  //  Misc variables, mostly for return codes
-  //
-  void *fopenretval;
-  size_t len;
-  char *buffer;
-  string errorString;
-  struct stat statbuf;
-  size_t sourceSize;
-
-  try
+  for (size_t start = 0; start <= name.size();)
   {
+    size_t end = name.find('/', start);
+    if (end == string::npos)
+      end = name.size();
+    string part = name.substr(start, end - start);
+    if (part.empty() || part == "." || part == "..")
+      return false;
+    start = end + 1;
+  }
+  return true;
+}
 
-    //
-    // Read whole input file
-    //
+bool makeDirectories(string dir, string name)
+{
+  for (size_t slash = name.find('/'); slash != string::npos; slash = name.find('/', slash + 1))
+  {
+    string path = makeFileName(dir, name.substr(0, slash));
+    if (mkdir(path.c_str(), 0755) == 0)
+      continue;
 
-    string sourceName = makeFileName(sourceDir, fileName);
-    if (lstat(sourceName.c_str(), &statbuf) != 0)
+    // something already there has to be a directory, and not a link to one elsewhere
+    struct stat statbuf;
+    if (errno != EEXIST || lstat(path.c_str(), &statbuf) != 0 || !S_ISDIR(statbuf.st_mode))
     {
-      string err = "File not found ";
-      throw C150Exception(err + sourceName);
+      cerr << "Error creating directory " << path << " errno=" << strerror(errno) << endl;
+      return false;
     }
+  }
+  return true;
+}
 
-    //
-    // Make an input buffer large enough for
-    // the whole file
-    //
-    sourceSize = statbuf.st_size;
-    buffer = (char *)malloc(sourceSize);
-
-    //
-    // Define the wrapped file descriptors
-    //
-    // All the operations on outputFile are the same
-    // ones you get documented by doing "man 3 fread", etc.
-    // except that the file descriptor arguments must
-    // be left off.
-    //
-    // Note: the NASTYFILE type is meant to be similar
-    //       to the Unix FILE type
-    //
-    NASTYFILE inputFile(nastiness); // See c150nastyfile.h for interface
-
-    // do an fopen on the input file
-    fopenretval = inputFile.fopen(sourceName.c_str(), "rb");
-    // wraps Unix fopen
-    // Note rb gives "read, binary"
-    // which avoids line end munging
-
-    if (fopenretval == NULL)
-    {
-      throw C150Exception("File open failed.");
-    }
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     packetChecksum
+//
+//        CRC-32C over a data packet's ids and its len bytes of data,
+//        folded to 16 bits, so the server can throw away packets the
+//        network mangled instead of using them.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    //
-    // Read the whole file
-    //
-    len = inputFile.fread(buffer, 1, sourceSize);
+unsigned short packetChecksum(const TransmissionPacket &pckt, size_t len)
+{
+  const char *bytes = reinterpret_cast<const char *>(&pckt.fileId);
+  unsigned int crc = crc32c(bytes, PACKET_HEADER - offsetof(TransmissionPacket, fileId) + len);
+  return (unsigned short)(crc ^ (crc >> 16));
+}
 
-    if (len != sourceSize)
-    {
-      cerr << "Error reading file " << sourceName << "  errno=" << strerror(errno) << endl;
-      exit(16);
-    }
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     xorBytes
+//
+//        dest ^= src, for len bytes, a word at a time.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    unsigned char obuf[20];
+void xorBytes(char *dest, const char *src, size_t len)
+{
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+  {
+    uint64_t a, b;
+    memcpy(&a, dest + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dest + i, &a, sizeof(a));
+  }
+  for (; i < len; i++)
+    dest[i] ^= src[i];
+}
 
-    SHA1((const unsigned char *)buffer,
-         len, obuf);
-    free(buffer);
-    if (inputFile.fclose() != 0)
-    {
-      cerr << "Error closing input file " << sourceName << " errno=" << strerror(errno) << endl;
-      exit(16);
-    }
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     makeLayout
+//
+//        packets and blocks for a payload. Blocks stay near BLOCK_BYTES,
+//        so bigger payloads mean fewer packets per block.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    // note: file must be null terminated for this to work.
-    return getHexRepresentation(obuf, 20);
-  }
-  catch (C150Exception &e)
+Layout makeLayout(unsigned int payload)
+{
+  Layout layout;
+  layout.payload = min(max(payload, (unsigned int)SEND_SIZE), MAX_PAYLOAD);
+  layout.blockPackets = max(size_t(1), min(size_t(CHECK_SIZE), BLOCK_BYTES / layout.payload));
+  return layout;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     knownDigest / blockDigest
+//
+//        digest of one check block, in the first bytes of obuf and
+//        zeros after. SHA-1 fills all 20 bytes, CRC32C the first 4.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool knownDigest(unsigned char digest)
+{
+  return digest == DIGEST_SHA1 || digest == DIGEST_CRC32C;
+}
+
+void blockDigest(unsigned char digest, const char *data, size_t len, unsigned char obuf[20])
+{
+  if (digest == DIGEST_CRC32C)
   {
-    cerr << "nastyfiletest:copyfile(): Caught C150Exception: " << e.formattedExplanation() << endl;
-    return "";
+    unsigned int crc = crc32c(data, len);
+    memset(obuf, 0, 20);
+    memcpy(obuf, &crc, sizeof(crc));
+    return;
   }
+  SHA1((const unsigned char *)data, len, obuf);
 }
 
+// codecs we can inflate, so we can agree to them
+bool knownCodec(unsigned char codec)
+{
+  return codec == CODEC_NONE || codec == CODEC_ZLIB;
+}
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
-//                     writeMsg
+//                     checkDigest
 //
-//        writes a message until a correct response is given.
+//        one block's digest is its own check digest. For more, it's
+//        the digest of their digests, so neither side hashes the data
+//        of a block twice.
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-void WriteHelper::writeMsg(C150NastyDgmSocket *sock, TransmissionPacket outgoing, int attempts)
+void checkDigest(unsigned char digest, const vector<Hash> &blocks, unsigned char obuf[20])
 {
-  // bool timeout = true;
-  // Continue try to send the message attempts time, or if it timeouts.
-  for (int i = 0; i < attempts; i++)
+  if (blocks.size() == 1)
   {
-
-    memcpy(w, &outgoing, sizeof(w));
-    sock->write(w, sizeof(w));
-
-    // ssize_t readlen = sock -> read(w, sizeof(w));
-    // timeout = sock -> timedout();
-
-    // if (readlen == 0) {
-    //     c150debug->printf(C150APPLICATION,"Read zero length message, trying again");
-    //     continue;
-    // }
-    // // While sock doesn't time out and wrong packet recieved, continue getting messages
-    // while(!timeout) {
-    //     TransmissionResponsePacket pckt = *(reinterpret_cast<TransmissionResponsePacket*>(w));
-    //     if(outgoing.cmd == pckt.cmd && pckt.fileId == outgoing.fileId && pckt.packetId == outgoing.packetId) {
-    //       return outgoing;
-    //     } else {
-    //       timeout = true;
-    //       readlen = sock -> read(w, sizeof(w));
-    //       timeout = sock -> timedout();
-    //       if (readlen == 0) {
-    //         c150debug->printf(C150APPLICATION,"Read zero length message, trying again");
-    //         break;
-    //        }
-    //     }
-
-    //   }
+    memcpy(obuf, blocks[0].obuf, 20);
+    return;
   }
-  // throw C150Exception("Network down.");
+  blockDigest(digest, reinterpret_cast<const char *>(blocks.data()), blocks.size() * sizeof(Hash), obuf);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
-//                     writeMsg
+//                     crc32c
+//
+//        CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when
+//        the CPU has it, and a table a byte at a time otherwise.
 //
-//        writes a message until a correct response is given.
+//        Each crc32 instruction has to wait for the one before it, so
+//        one stream runs at a third of what the CPU can do. Longer
+//        data is cut in three, run as three streams side by side, and
+//        joined by shifting the first two past what follows them: the
+//        CRC register after n more bytes is the register times x^8n.
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-StartPacket WriteHelper::writeMsg(C150NastyDgmSocket *sock, StartPacket outgoing, int attempts)
-{
-  bool timeout = true;
+// Shortest data worth cutting into three streams.
+static const size_t CRC32C_STREAMS_MIN = 768;
 
-  // Continue try to send the message attempts time, or if it timeouts.
-  for (int i = 0; i < attempts && timeout; i++)
+static unsigned int crc32cTable[256];
+
+static void makeCrc32cTable()
+{
+  for (unsigned int i = 0; i < 256; i++)
   {
+    unsigned int crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    crc32cTable[i] = crc;
+  }
+}
 
-    memcpy(w, &outgoing, sizeof(w));
-    sock->write(w, sizeof(w));
+static unsigned int crc32cSoftware(unsigned int crc, const unsigned char *bytes, size_t len)
+{
+  static bool tableReady = (makeCrc32cTable(), true);
+  (void)tableReady;
 
-    ssize_t readlen = sock->read(w, sizeof(w));
-    timeout = sock->timedout();
+  for (size_t i = 0; i < len; i++)
+    crc = crc32cTable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
 
-    if (readlen == 0)
-    {
-      c150debug->printf(C150APPLICATION, "Read zero length message, trying again");
-      continue;
-    }
-    // While sock doesn't time out and wrong packet recieved, continue getting messages
-    while (!timeout)
+// a times b modulo the CRC-32C polynomial, both bit reflected like the register
+static unsigned int crc32cMultiply(unsigned int a, unsigned int b)
+{
+  unsigned int product = 0;
+  for (unsigned int bit = 1u << 31; bit != 0; bit >>= 1)
+  {
+    if (a & bit)
+      product ^= b;
+    b = (b >> 1) ^ (0x82F63B78 & (0 - (b & 1)));
+  }
+  return product;
+}
+
+// x^8n modulo the polynomial, by squaring. Blocks are mostly one size, so the last one is kept.
+static unsigned int crc32cShift(size_t n)
+{
+  thread_local size_t lastN = 0;
+  thread_local unsigned int lastShift = 1u << 31;
+  if (n == lastN)
+    return lastShift;
+
+  unsigned int shift = 1u << 31;  // x^0
+  unsigned int power = 1u << 23;  // x^8
+  for (size_t left = n; left != 0; left >>= 1)
+  {
+    if (left & 1)
+      shift = crc32cMultiply(power, shift);
+    power = crc32cMultiply(power, power);
+  }
+  lastN = n;
+  lastShift = shift;
+  return shift;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static unsigned int crc32cHardware(unsigned int crc, const unsigned char *bytes, size_t len)
+{
+  if (len >= CRC32C_STREAMS_MIN)
+  {
+    size_t lane = len / 3 / 8 * 8;
+    unsigned long long a = crc, b = 0, c = 0;
+    for (size_t i = 0; i < lane; i += 8)
     {
-      StartResponsePacket pckt = *(reinterpret_cast<StartResponsePacket *>(w));
-      if (outgoing.cmd == pckt.cmd && outgoing.fileSz == pckt.fileSz)
-      {
-        // comparing the two filenames
-        for (long unsigned int i = 0; i < 256; i++)
-        {
-          if (outgoing.name[i] != pckt.name[i])
-          {
-            timeout = true;
-            break;
-          }
-          else if (outgoing.name[i] == '\0')
-            break;
-        }
-
-        if (!timeout)
-          return outgoing;
-      }
-      else
-      {
-        timeout = true;
-        readlen = sock->read(w, sizeof(w));
-        timeout = sock->timedout();
-        if (readlen == 0)
-        {
-          c150debug->printf(C150APPLICATION, "Read zero length message, trying again");
-          break;
-        }
-      }
+      unsigned long long wordA, wordB, wordC;
+      memcpy(&wordA, bytes + i, sizeof(wordA));
+      memcpy(&wordB, bytes + lane + i, sizeof(wordB));
+      memcpy(&wordC, bytes + 2 * lane + i, sizeof(wordC));
+      a = _mm_crc32_u64(a, wordA);
+      b = _mm_crc32_u64(b, wordB);
+      c = _mm_crc32_u64(c, wordC);
     }
+    unsigned int shift = crc32cShift(lane);
+    crc = crc32cMultiply(shift, crc32cMultiply(shift, (unsigned int)a) ^ (unsigned int)b) ^ (unsigned int)c;
+    bytes += 3 * lane;
+    len -= 3 * lane;
+  }
+
+  unsigned long long crc64 = crc;
+  for (; len >= 8; bytes += 8, len -= 8)
+  {
+    unsigned long long word;
+    memcpy(&word, bytes, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
   }
-  throw C150Exception("Network down.");
+  crc = (unsigned int)crc64;
+  for (; len > 0; bytes++, len--)
+    crc = _mm_crc32_u8(crc, *bytes);
+  return crc;
+}
+#endif
+
+unsigned int crc32c(const char *data, size_t len)
+{
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+#if defined(__x86_64__)
+  static bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware)
+    return ~crc32cHardware(~0u, bytes, len);
+#endif
+  return ~crc32cSoftware(~0u, bytes, len);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
-//                     writeMsg
+//                     TreeHash
 //
-//        writes a message until a correct response is given.
+//        feeds bytes into the current leaf, and each leaf's digest
+//        into the root as the leaf fills. final leaves the running
+//        hash as it was, so it can go on.
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-EndToEndResponsePacket WriteHelper::writeMsg(C150NastyDgmSocket *sock, EndToEndPacket outgoing, int attempts)
+TreeHash::TreeHash()
+{
+  SHA1_Init(&root);
+  SHA1_Init(&leaf);
+}
+
+void TreeHash::update(const char *data, size_t len)
 {
-  bool timeout = true;
-  for (int i = 0; i < attempts && timeout; i++)
+  while (len > 0)
   {
-    memcpy(w, &outgoing, sizeof(EndToEndPacket));
+    size_t take = min(len, TREE_LEAF - leafBytes);
+    SHA1_Update(&leaf, data, take);
+    leafBytes += take;
+    data += take;
+    len -= take;
 
-    // Cntinue try to send the message attempts time, or if it timeouts.
-    sock->write(w, sizeof(w));
+    if (leafBytes == TREE_LEAF)
+    {
+      unsigned char digest[20];
+      SHA1_Final(digest, &leaf);
+      SHA1_Update(&root, digest, sizeof(digest));
+      SHA1_Init(&leaf);
+      leafBytes = 0;
+    }
+  }
+}
 
-    ssize_t readlen = sock->read(w, sizeof(w));
-    timeout = sock->timedout();
+void TreeHash::final(unsigned char obuf[20]) const
+{
+  SHA_CTX done = root;
+  if (leafBytes > 0)
+  {
+    SHA_CTX last = leaf;
+    unsigned char digest[20];
+    SHA1_Final(digest, &last);
+    SHA1_Update(&done, digest, sizeof(digest));
+  }
+  SHA1_Final(obuf, &done);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     hashThreads / treeHash
+//
+//        hashes a file's leaves on a pool of threads, each taking
+//        the next leaf nobody has yet, then the root from their
+//        digests in order. Every thread has one leaf of memory, so
+//        a file of any size needs only a few. At least two threads,
+//        so reading one leaf overlaps hashing another even on one
+//        core, unless HASH_THREADS_ENV asks for some other number.
+//        A file of one leaf is hashed on the calling thread.
+//
+//        Leaf buffers are kept for the next file once a hash is
+//        done, up to hashThreads() of them. A thread that can't get
+//        one leaves its leaves to the others.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    if (readlen == 0)
+unsigned int hashThreads()
+{
+  static const unsigned int threads = []() {
+    unsigned int cores = max(2u, thread::hardware_concurrency());
+    const char *setting = getenv(HASH_THREADS_ENV);
+    if (setting == nullptr)
+      return cores;
+    char *end;
+    unsigned long n = strtoul(setting, &end, 10);
+    if (*setting == '\0' || *end != '\0' || n == 0 || n > MAX_HASH_THREADS)
     {
-      c150debug->printf(C150APPLICATION, "Read zero length message, trying again");
-      continue;
+      cerr << HASH_THREADS_ENV << "=" << setting << " is not a thread count from 1 to " << MAX_HASH_THREADS
+           << ", using " << cores << endl;
+      return cores;
     }
-    // While sock doesn't time out and wrong packet recieved, continue getting messages.
-    while (!timeout)
+    return (unsigned int)n;
+  }();
+  return threads;
+}
+
+static mutex spareLock;
+static vector<char *> spareBuffers;
+
+static char *takeLeafBuffer()
+{
+  {
+    lock_guard<mutex> guard(spareLock);
+    if (!spareBuffers.empty())
     {
-      EndToEndResponsePacket pckt = *(reinterpret_cast<EndToEndResponsePacket *>(w));
-      if (outgoing.cmd == pckt.cmd && outgoing.fileId == pckt.fileId && outgoing.packetId == pckt.packetId)
-      {
-        return pckt;
-      }
-      else
-      {
-        timeout = true;
-        readlen = sock->read(w, sizeof(w));
-        timeout = sock->timedout();
-        if (readlen == 0)
-        {
-          c150debug->printf(C150APPLICATION, "Read zero length message, trying again");
-          break;
-        }
-      }
+      char *buffer = spareBuffers.back();
+      spareBuffers.pop_back();
+      return buffer;
     }
   }
+  char *buffer = static_cast<char *>(aligned_alloc(HASH_ALIGN, TREE_LEAF));
+  if (buffer == nullptr)
+    cerr << "Error allocating a " << TREE_LEAF << " byte buffer to hash with" << endl;
+  return buffer;
+}
 
-  throw C150Exception("Network down.");
+static void giveLeafBuffer(char *buffer)
+{
+  lock_guard<mutex> guard(spareLock);
+  if (buffer != nullptr && spareBuffers.size() < hashThreads())
+    spareBuffers.push_back(buffer);
+  else
+    free(buffer);
 }
 
-ConfirmPacket WriteHelper::writeMsg(C150NastyDgmSocket *sock, ConfirmPacket outgoing, int attempts)
+bool treeHash(size_t size, const ChunkReader &read, unsigned char obuf[20], unsigned int threads)
 {
-  bool timeout = true;
+  size_t leaves = (size + TREE_LEAF - 1) / TREE_LEAF;
+  vector<Hash> digests(leaves);
+  atomic<size_t> next(0);
+  atomic<size_t> hashed(0);
+  atomic<bool> ok(true);
 
-  // Continue try to send the message attempts time, or if it timeouts.
-  for (int i = 0; i < attempts && timeout; i++)
+  auto work = [&]()
   {
-
-    memcpy(w, &outgoing, sizeof(w));
-    sock->write(w, sizeof(w));
-
-    ssize_t readlen = sock->read(w, sizeof(w));
-    timeout = sock->timedout();
-
-    if (readlen == 0)
+    char *buffer = takeLeafBuffer();
+    for (size_t i = buffer != nullptr ? next++ : leaves; i < leaves && ok; i = next++)
     {
-      c150debug->printf(C150APPLICATION, "Read zero length message, trying again");
-      continue;
-    }
-    // While sock doesn't time out and wrong packet recieved, continue getting messages
-    while (!timeout)
-    {
-      ConfirmPacket pckt = *(reinterpret_cast<ConfirmPacket *>(w));
-      if (pckt.cmd == outgoing.cmd)
+      size_t offset = i * TREE_LEAF;
+      size_t len = min(TREE_LEAF, size - offset);
+      const char *data = read(offset, buffer, len);
+      if (data == nullptr)
       {
-        // comparing the two filenames
-        for (long unsigned int i = 0; i < 256; i++)
-        {
-          if (outgoing.name[i] != pckt.name[i])
-          {
-            timeout = true;
-            break;
-          }
-          else if (outgoing.name[i] == '\0')
-            break;
-        }
-
-        if (!timeout)
-          return pckt;
-      }
-      else
-      {
-        timeout = true;
-        readlen = sock->read(w, sizeof(w));
-        timeout = sock->timedout();
-        if (readlen == 0)
-        {
-          c150debug->printf(C150APPLICATION, "Read zero length message, trying again");
-          break;
-        }
+        ok = false;
+        break;
       }
+      SHA1((const unsigned char *)data, len, digests[i].obuf);
+      hashed++;
     }
+    giveLeafBuffer(buffer);
+  };
+
+  if (leaves <= 1 || threads <= 1)
+    work();
+  else
+  {
+    vector<thread> pool;
+    for (size_t t = 0; t < min(size_t(threads), leaves); t++)
+      pool.emplace_back(work);
+    for (size_t t = 0; t < pool.size(); t++)
+      pool[t].join();
   }
-  throw C150Exception("Network down.");
+  if (!ok || hashed < leaves)
+    return false;
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  for (size_t i = 0; i < leaves; i++)
+    SHA1_Update(&ctx, digests[i].obuf, sizeof(digests[i].obuf));
+  SHA1_Final(obuf, &ctx);
+  return true;
 }
 
-Hash *newHash(unsigned char obuf[20])
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     sendMsg
+//
+//        writes a single message without waiting for a response.
+//        the client's scheduler and sliding window decide when to resend.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void WriteHelper::sendMsg(C150NastyDgmSocket *sock, StartPacket outgoing)
+{
+  memset(w, 0, sizeof(w));
+  memcpy(w, &outgoing, sizeof(outgoing));
+  sock->write(w, sizeof(w));
+}
+
+// data packets go straight from the caller's packet, header and len bytes of data
+void WriteHelper::sendMsg(C150NastyDgmSocket *sock, const TransmissionPacket &outgoing, size_t len)
+{
+  sock->write(reinterpret_cast<const char *>(&outgoing), PACKET_HEADER + len);
+}
+
+void WriteHelper::sendMsg(C150NastyDgmSocket *sock, EndToEndPacket outgoing)
+{
+  memset(w, 0, sizeof(w));
+  memcpy(w, &outgoing, sizeof(outgoing));
+  sock->write(w, sizeof(w));
+}
+
+void WriteHelper::sendMsg(C150NastyDgmSocket *sock, ConfirmPacket outgoing)
+{
+  memset(w, 0, sizeof(w));
+  memcpy(w, &outgoing, sizeof(outgoing));
+  sock->write(w, sizeof(w));
+}
+
+void WriteHelper::sendMsg(C150NastyDgmSocket *sock, MerklePacket outgoing)
+{
+  memset(w, 0, sizeof(w));
+  memcpy(w, &outgoing, sizeof(outgoing));
+  sock->write(w, sizeof(w));
+}
+
+void WriteHelper::sendMsg(C150NastyDgmSocket *sock, SignaturePacket outgoing)
+{
+  memset(w, 0, sizeof(w));
+  memcpy(w, &outgoing, sizeof(outgoing));
+  sock->write(w, sizeof(w));
+}
+
+void WriteHelper::sendMsg(C150NastyDgmSocket *sock, CopyPacket outgoing)
+{
+  memset(w, 0, sizeof(w));
+  memcpy(w, &outgoing, sizeof(outgoing));
+  sock->write(w, sizeof(w));
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     rttSample / backoff / rtt / minRtt / rto
+//
+//        the RFC 6298 estimator: SRTT and RTTVAR move 1/8 and 1/4
+//        of the way to each sample. A sample also ends any backoff.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void WriteHelper::rttSample(Clock::duration rtt)
 {
-  Hash *hash = new Hash;
-  for (int i = 0; i < 20; i++)
+  if (!measured)
   {
-    hash->obuf[i] = obuf[i];
+    srtt = rtt;
+    rttvar = rtt / 2;
+    measured = true;
   }
-  return hash;
-}
\ No newline at end of file
+  else
+  {
+    Clock::duration err = rtt > srtt ? rtt - srtt : srtt - rtt;
+    rttvar = (3 * rttvar + err) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+  }
+  minrtt = min(minrtt, rtt);
+  backoffs = 0;
+}
+
+// called when something we sent timed out
+void WriteHelper::backoff()
+{
+  if (backoffs < MAX_BACKOFFS)
+    backoffs++;
+}
+
+// smoothed round trip, or the initial RTO until there is a sample
+Clock::duration WriteHelper::rtt()
+{
+  return measured ? max(srtt, Clock::duration(std::chrono::microseconds(1))) : INITIAL_RTO;
+}
+
+// smallest round trip seen, so the one with no queueing in it
+Clock::duration WriteHelper::minRtt()
+{
+  return measured ? max(minrtt, Clock::duration(std::chrono::microseconds(1))) : INITIAL_RTO;
+}
+
+// timeout for a message that has already been resent resends times
+Clock::duration WriteHelper::rto(unsigned int resends)
+{
+  Clock::duration base = measured ? srtt + 4 * rttvar : INITIAL_RTO;
+  base = min(max(base, MIN_RTO), MAX_RTO);
+  unsigned int doublings = min(backoffs + resends, MAX_BACKOFFS);
+  return min(base * (1 << doublings), MAX_RTO);
+}
@@ -4,6 +4,9 @@
 //     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
 //
 
+#ifndef FILEHELPER_H
+#define FILEHELPER_H
+
 #include <string>
 #include <cstdlib>
 #include <fstream>
@@ -11,21 +14,92 @@
 #include <stdio.h>
 #include <openssl/sha.h>
 #include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <functional>
 #include "c150nastydgmsocket.h"
 
 using namespace std;
 using namespace C150NETWORK; // for all the comp150 utilities
 
+typedef std::chrono::steady_clock Clock;
+
 string getHexRepresentation(const unsigned char *bytes, size_t len);
 void checkDirectory(char *dirname);
-string hashFile(string sourceDir, string fileName, int nastiness);
 string makeFileName(string dir, string name);
+bool safeName(const string &name);
+bool makeDirectories(string dir, string name);
+
+// Smallest data payload per packet; every server takes at least this much.
+const int SEND_SIZE = 500;
+
+// Largest data payload either side will agree to, near the 65507 bytes a UDP datagram can carry.
+const unsigned int MAX_PAYLOAD = 65000;
+
+// The payload the client asks for in its StartPacket.
+const unsigned int PREFERRED_PAYLOAD = 8000;
+
+// Most packets one 'e' check may cover, which is what its missing bitmap holds.
+const int CHECK_SIZE = 250;
+
+// Bytes a block aims for. With bigger payloads a block has fewer packets.
+// An 'e' check covers a run of whole blocks, as many as the client picks.
+const size_t BLOCK_BYTES = 32000;
+
+// Bytes that data read or written through file nastiness is compared in.
+// Only a chunk that doesn't match is read or written again.
+const size_t VERIFY_CHUNK = 4096;
+
+// How a file is cut into packets and blocks, agreed in the start handshake.
+struct Layout
+{
+    unsigned int payload = SEND_SIZE; // data bytes per packet
+    unsigned int blockPackets = 64;   // packets per block
+    size_t blockBytes() const { return size_t(payload) * blockPackets; }
+};
+
+Layout makeLayout(unsigned int payload);
+
+// Digests for the per-block 'e' checks. The client asks for one in its StartPacket
+// and the server answers with the one it will use. The 'f' check is always a TreeHash.
+enum BlockDigest
+{
+    DIGEST_SHA1 = 0,
+    DIGEST_CRC32C = 1
+};
+
+// The digest the client asks for.
+const unsigned char PREFERRED_DIGEST = DIGEST_CRC32C;
+
+bool knownDigest(unsigned char digest);
+void blockDigest(unsigned char digest, const char *data, size_t len, unsigned char obuf[20]);
+unsigned int crc32c(const char *data, size_t len);
+
+// Codecs a block's data can be compressed with. The client asks for one in its
+// StartPacket and the server answers with the one it will take.
+enum BlockCodec
+{
+    CODEC_NONE = 0,
+    CODEC_ZLIB = 1
+};
+
+// The codec the client asks for, and the zlib level it compresses at:
+// 1 is fastest, 9 smallest.
+const unsigned char PREFERRED_CODEC = CODEC_ZLIB;
+const int COMPRESSION_LEVEL = 1;
+
+bool knownCodec(unsigned char codec);
 
 struct StartPacket
 {
     char cmd;
     char name[255];
-    unsigned int fileSz;
+    uint64_t fileSz;
+    unsigned char digest;  // BlockDigest the client would like
+    unsigned int payload;  // largest data payload the client would like
+    unsigned char hash[20]; // TreeHash of the whole file, so the server can tell if it has it already
+    unsigned char codec;    // BlockCodec the client would like
 };
 
 struct StartResponsePacket
@@ -33,21 +107,26 @@ struct StartResponsePacket
     char cmd;
     char name[255];
     unsigned int fileId;
-    unsigned int fileSz;
+    uint64_t fileSz;
+    unsigned char digest;  // BlockDigest both sides use for this file
+    unsigned int payload;  // data payload both sides use for this file
+    uint64_t baseSize;     // bytes of the server's old copy of the file, 0 if it has none
+    bool identical;        // the server already has exactly this file, so there's nothing to send
+    unsigned char codec;   // BlockCodec both sides use for this file
+    unsigned int resumeBlock; // blocks from the start the server has verified, from a transfer cut short
+    bool refused;          // the server can't take a file by this name, so the client should give up on it
 };
 
+// An 'e' check covers count packets from packetId, which must start a block
+// and end one, or end the file. 'f' leaves both 0. obuf is the client's own
+// check digest, so the server knows which blocks passed and can journal them.
 struct EndToEndPacket
 {
     char cmd;
     unsigned int fileId;
     unsigned int packetId;
-};
-
-struct EndToEndFinalPacket
-{
-    char cmd;
-    unsigned int fileId;
-    unsigned int packetId;
+    unsigned int count;
+    unsigned char obuf[20];
 };
 
 struct EndToEndResponsePacket
@@ -55,7 +134,10 @@ struct EndToEndResponsePacket
     char cmd;
     unsigned int fileId;
     unsigned int packetId;
+    unsigned int count;
     unsigned char obuf[20];
+    // 'e' responses only: bit i set means packetId + i never arrived intact.
+    unsigned char missing[(CHECK_SIZE + 7) / 8];
 };
 
 struct ConfirmPacket
@@ -65,21 +147,124 @@ struct ConfirmPacket
     bool success;
 };
 
+// Only the header and the bytes actually carried are sent, so the datagram is
+// PACKET_HEADER plus at most the file's payload.
+//
+// A block that compresses is sent as its compressed bytes instead, cut into
+// payload sized pieces. Piece k goes where packet k of the block would, and
+// packed says how long the whole compressed block is, so the server knows
+// how many pieces to wait for before it can inflate it.
+//
+// An 'x' parity packet has the same layout. Its bytes are the XOR of group
+// packets (or pieces) of one block, starting with the one at offset, each
+// zero padded to the first one's length. With it, the server can rebuild
+// any one of them that goes missing without waiting for the client.
 struct TransmissionPacket
 {
     char cmd;
+    unsigned char repair;    // resent after a failed check, so the server must rewrite it
+    unsigned short checksum; // fits in the padding after cmd, covers everything after it
+    unsigned int fileId;
+    uint64_t offset;         // where bytes goes in the file
+    unsigned int packed;     // compressed bytes in the block bytes is a piece of, 0 for raw data
+    unsigned char group;     // 'x' only: packets the parity covers
+    unsigned char resent;    // not the first time this packet went out, so the server can count losses
+    char bytes[MAX_PAYLOAD];
+    TransmissionPacket() : cmd('i'), repair(0), checksum(0), fileId(0), offset(0), packed(0), group(0), resent(0) {}
+};
+
+const size_t PACKET_HEADER = offsetof(TransmissionPacket, bytes);
+
+// Largest datagram either side sends or reads.
+const size_t MAX_DATAGRAM = PACKET_HEADER + MAX_PAYLOAD;
+
+unsigned short packetChecksum(const TransmissionPacket &pckt, size_t len);
+void xorBytes(char *dest, const char *src, size_t len);
+
+// Most data packets the server acknowledges in one 'a' datagram. Fixed, as
+// it sizes AckPacket on the wire, so both sides must agree on it.
+const unsigned int ACK_BATCH = 32;
+
+struct AckRecord
+{
     unsigned int fileId;
     unsigned int packetId;
-    char bytes[500];
-    TransmissionPacket() : cmd('i'), fileId(0), packetId(0) {}
 };
 
-struct TransmissionResponsePacket
+// Acks for up to ACK_BATCH data packets, possibly for different files.
+struct AckPacket
+{
+    char cmd;
+    unsigned char lost;    // how many of these packets' first sends never got here
+    unsigned short count;
+    AckRecord acks[ACK_BATCH];
+    AckPacket() : cmd('a'), lost(0), count(0) {}
+};
+
+static_assert(sizeof(AckPacket) <= 512, "ACK_BATCH acks must fit in one datagram");
+
+// Most Merkle tree digests in one 'm' response.
+const unsigned int MERKLE_BATCH = 64;
+
+// Asks for the digests of nodes first .. first + count - 1 at one level of a file's Merkle tree.
+struct MerklePacket
+{
+    char cmd;
+    unsigned int fileId;
+    unsigned int level;
+    unsigned int first;
+    unsigned int count;
+};
+
+struct MerkleResponsePacket
+{
+    char cmd;
+    unsigned int fileId;
+    unsigned int level;
+    unsigned int first;
+    unsigned int count;
+    unsigned int digests[MERKLE_BATCH];
+};
+
+// The rsync signature of one payload sized piece of the server's old copy of a file.
+struct Signature
+{
+    unsigned int weak;   // RollingChecksum of the bytes
+    unsigned int strong; // CRC-32C of the bytes
+};
+
+// Most signatures in one 'g' response.
+const unsigned int SIGNATURE_BATCH = 60;
+
+// Asks for the signatures of pieces first .. first + count - 1 of the server's old copy.
+struct SignaturePacket
+{
+    char cmd;
+    unsigned int fileId;
+    unsigned int first;
+    unsigned int count;
+};
+
+struct SignatureResponsePacket
+{
+    char cmd;
+    unsigned int fileId;
+    unsigned int first;
+    unsigned int count;
+    Signature signatures[SIGNATURE_BATCH];
+};
+
+static_assert(sizeof(SignatureResponsePacket) <= 512, "SIGNATURE_BATCH signatures must fit in one datagram");
+
+// Tells the server packets packetId .. packetId + count - 1 are the bytes of its old
+// copy from offset base on, instead of sending them. Each one is acked like a data packet.
+struct CopyPacket
 {
     char cmd;
     unsigned int fileId;
     unsigned int packetId;
-    TransmissionResponsePacket() : cmd('i'), fileId(0), packetId(0) {}
+    unsigned int count;
+    uint64_t base;
 };
 
 struct Hash
@@ -87,20 +272,85 @@ struct Hash
     unsigned char obuf[20];
 };
 
-Hash *newHash(unsigned char obuf[20]);
+// Digest for an 'e' check over several blocks, from each block's own digest.
+void checkDigest(unsigned char digest, const vector<Hash> &blocks, unsigned char obuf[20]);
+
+// Bytes in each leaf of a file's tree hash, and what the buffers leaves are
+// read into are aligned to.
+const size_t TREE_LEAF = 1 << 20;
+const size_t HASH_ALIGN = 4096;
+
+// Environment variable that sets how many threads hash a file's leaves,
+// instead of one per core, and the most it may ask for. Each one holds a
+// leaf in memory.
+const char *const HASH_THREADS_ENV = "HASH_THREADS";
+const unsigned int MAX_HASH_THREADS = 64;
+
+// Points at len bytes of a file at offset for treeHash, read into dest unless
+// they're in memory already. nullptr if they couldn't be read. treeHash calls
+// it from several threads at once.
+typedef function<const char *(size_t offset, char *dest, size_t len)> ChunkReader;
 
+// A file's digest for the 'f' check: the SHA-1 of the SHA-1s of each
+// TREE_LEAF bytes of it in turn, so the leaves can be hashed on every core.
+// TreeHash builds it from the file's bytes in order, like a SHA_CTX, and
+// copies like one, so the server can save it in its journal.
+struct TreeHash
+{
+    SHA_CTX root;         // digests of the leaves so far
+    SHA_CTX leaf;         // bytes of the leaf after them
+    size_t leafBytes = 0; // how many
+    TreeHash();
+    void update(const char *data, size_t len);
+    void final(unsigned char obuf[20]) const;
+};
+
+unsigned int hashThreads();
+
+// treeHash hashes threads leaves at once, each read by the thread hashing
+// it, so one is read while another is hashed, in constant memory. Errors
+// come back in its result, never by exiting: it returns false, with obuf
+// untouched, if a read fails or there's no memory to read into, and the
+// caller gives up on just that file.
+bool treeHash(size_t size, const ChunkReader &read, unsigned char obuf[20], unsigned int threads = hashThreads());
+
+// Resend timeout before any round trip has been measured, the bounds it is kept
+// within, and how many times in a row it may double while nothing is acked.
+const Clock::duration INITIAL_RTO = std::chrono::milliseconds(200);
+const Clock::duration MIN_RTO = std::chrono::milliseconds(5);
+const Clock::duration MAX_RTO = std::chrono::seconds(2);
+const unsigned int MAX_BACKOFFS = 6;
+
+// Sends every message, and keeps the round trip estimates that decide when
+// anything unanswered goes out again: a smoothed RTT and its mean deviation,
+// giving RTO = SRTT + 4 * RTTVAR, doubled for every timeout since the last
+// sample. Samples only come from packets that went out once, so a response
+// is never matched to the wrong send.
 class WriteHelper
 {
 private:
     char w[512];
+    bool measured = false;
+    Clock::duration srtt = Clock::duration::zero();
+    Clock::duration rttvar = Clock::duration::zero();
+    Clock::duration minrtt = Clock::duration::max();
+    unsigned int backoffs = 0;
 
 public:
-    StartPacket writeMsg(C150NastyDgmSocket *sock, StartPacket msg, int attempts);
-    EndToEndResponsePacket writeMsg(C150NastyDgmSocket *sock, EndToEndPacket msg, int attempts);
-    void writeMsg(C150NastyDgmSocket *sock, TransmissionPacket msg, int attempts);
-    ConfirmPacket writeMsg(C150NastyDgmSocket *sock, ConfirmPacket msg, int attempts);
-};
+    void rttSample(Clock::duration rtt);
+    void backoff();
+    Clock::duration rto(unsigned int resends = 0);
+    Clock::duration rtt();
+    Clock::duration minRtt();
 
-const int SEND_SIZE = 500;
+    // sendMsg sends a single datagram and returns right away. Resending is up to the caller.
+    void sendMsg(C150NastyDgmSocket *sock, StartPacket msg);
+    void sendMsg(C150NastyDgmSocket *sock, const TransmissionPacket &msg, size_t len);
+    void sendMsg(C150NastyDgmSocket *sock, EndToEndPacket msg);
+    void sendMsg(C150NastyDgmSocket *sock, ConfirmPacket msg);
+    void sendMsg(C150NastyDgmSocket *sock, MerklePacket msg);
+    void sendMsg(C150NastyDgmSocket *sock, SignaturePacket msg);
+    void sendMsg(C150NastyDgmSocket *sock, CopyPacket msg);
+};
 
-const int CHECK_SIZE = 250;
+#endif
@@ -0,0 +1,236 @@
+//
+//        filereader.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "filereader.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <mutex>
+#include <iostream>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     FileReader
+//
+//        stats and opens the file, mapping it if we're allowed to.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+FileReader::FileReader(string dir, const char *fname, int filenast)
+    : sourceName(makeFileName(dir, fname)), inputFile(filenast)
+{
+    struct stat statbuf;
+
+    // This check should never fail.
+    if (lstat(sourceName.c_str(), &statbuf) != 0)
+    {
+        fprintf(stderr, "copyFile: Error stating supplied source file %s\n", sourceName.c_str());
+        exit(20);
+    }
+    sourceSize = statbuf.st_size;
+
+    // edge case: nothing to read from an empty file.
+    if (sourceSize == 0)
+        return;
+
+    // No file nastiness means reads can be trusted, so skip the copying and
+    // double reads and let the kernel page the file in as we go.
+    if (filenast == 0)
+    {
+        int fd = open(sourceName.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            void *addr = mmap(nullptr, sourceSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (addr != MAP_FAILED)
+            {
+                madvise(addr, sourceSize, MADV_SEQUENTIAL);
+                map = (char *)addr;
+                return;
+            }
+        }
+    }
+
+    if (inputFile.fopen(sourceName.c_str(), "rb") == NULL)
+    {
+        fprintf(stderr, "copyFile: Error opening source file %s\n", sourceName.c_str());
+        exit(20);
+    }
+    opened = true;
+}
+
+FileReader::~FileReader()
+{
+    if (map != nullptr)
+        munmap(map, sourceSize);
+
+    if (opened && inputFile.fclose() != 0)
+    {
+        cerr << "Error closing input file " << sourceName << " errno=" << strerror(errno) << endl;
+    }
+}
+
+size_t FileReader::size()
+{
+    return sourceSize;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     read
+//
+//    returns a pointer to len correct bytes of the file at offset.
+//    they're either in the mapping or copied into dest.
+//
+//    we found that the errors produced were different depending on
+//    what size reads we did, so we read the range whole and then in
+//    two halves. Where both agree we trust them; only the chunks
+//    where they don't are settled by reading again.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+const char *FileReader::read(size_t offset, size_t len, char *dest)
+{
+    if (map != nullptr)
+        return map + offset;
+
+    // a short range is read as part of a longer one, which also means a
+    // single byte anywhere but a one byte file has a neighbour to split
+    // from. The server's delta copies can ask for one anywhere.
+    if (len < SHORT_READ && sourceSize > len)
+    {
+        size_t window = min(SHORT_READ, sourceSize);
+        size_t start = min(offset, sourceSize - window);
+        char around[SHORT_READ];
+        memcpy(dest, read(start, window, around) + (offset - start), len);
+        return dest;
+    }
+
+    // one extra byte so a single byte read can ask for two (see below)
+    if (scratch.size() < len + 1)
+        scratch.resize(len + 1);
+
+    size_t half = (len + 1) / 2;
+    bool ok = false;
+
+    while (!ok)
+    {
+        ok = readAt(offset, dest, len, len);
+
+        if (len == 1)
+        {
+            // the whole of a one byte file, so ask for two to read it a
+            // second way; we still only get one back.
+            ok = readAt(offset, scratch.data(), 1, 2) && ok;
+        }
+        else
+        {
+            ok = readAt(offset, scratch.data(), half, half) && ok;
+            ok = readAt(offset + half, scratch.data() + half, len - half, len - half) && ok;
+        }
+    }
+
+    for (size_t start = 0; start < len; start += VERIFY_CHUNK)
+    {
+        size_t n = min(VERIFY_CHUNK, len - start);
+        if (memcmp(dest + start, scratch.data() + start, n) != 0)
+            settle(offset + start, dest + start, n, scratch.data() + start);
+    }
+    return dest;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     settle
+//
+//    the two reads of the len byte chunk at offset disagree, so at
+//    least one is wrong. Read it again until SETTLE_VOTES reads,
+//    counting those two, agree, and put that in dest.
+//
+//    A bad read spoils a byte somewhere in what it returns, so each
+//    read takes in up to VERIFY_CHUNK bytes either side as well,
+//    making it unlikely the chunk is what gets spoiled. Read k asks
+//    for k bytes more than the one before, so no two are the same
+//    size and agreeing reads are never one read size making the same
+//    mistake twice.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileReader::settle(size_t offset, char *dest, size_t len, const char *other)
+{
+    votes.clear();
+    votes.push_back(make_pair(crc32c(dest, len), 1u));
+    votes.push_back(make_pair(crc32c(other, len), 1u));
+
+    size_t before = min(offset, VERIFY_CHUNK);
+    size_t start = offset - before;
+    for (size_t extra = 1;; extra = extra % VERIFY_CHUNK + 1)
+    {
+        size_t request = before + len + VERIFY_CHUNK + extra;
+        if (reread.size() < request)
+            reread.resize(request);
+        if (!readAt(start, reread.data(), min(request, sourceSize - start), request))
+            continue;
+
+        unsigned int crc = crc32c(reread.data() + before, len);
+        vector<pair<unsigned int, unsigned int>>::iterator vote = votes.begin();
+        while (vote != votes.end() && vote->first != crc)
+            vote++;
+        if (vote == votes.end())
+        {
+            votes.push_back(make_pair(crc, 1u));
+            continue;
+        }
+        if (++vote->second == SETTLE_VOTES)
+        {
+            memcpy(dest, reread.data() + before, len);
+            return;
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     treeHash
+//
+//        TreeHash of the whole file. Leaves of a mapped file are
+//        hashed in place, all at once. Otherwise each is read twice
+//        like any other range, one leaf at a time, while others are
+//        being hashed. Returns false if memory for the leaves ran
+//        out, so only this file is given up on.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileReader::treeHash(unsigned char obuf[20])
+{
+    mutex lock;
+    bool ok = ::treeHash(sourceSize, [&](size_t offset, char *dest, size_t len) {
+        lock_guard<mutex> guard(lock);
+        return read(offset, len, dest);
+    }, obuf);
+
+    // read always gets its bytes in the end, so only memory can run out
+    if (!ok)
+        fprintf(stderr, "treeHash: Error hashing source file %s\n", sourceName.c_str());
+    return ok;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     readAt
+//
+//    one seek and fread of request bytes, of which we expect len.
+//    returns false on a short read so the caller tries again.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileReader::readAt(size_t offset, char *dest, size_t len, size_t request)
+{
+    inputFile.fseek(offset, SEEK_SET);
+    return inputFile.fread(dest, 1, request) == len;
+}
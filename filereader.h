@@ -0,0 +1,52 @@
+//
+//        filereader.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef FILEREADER_H
+#define FILEREADER_H
+
+#include "filehelper.h"
+#include "c150nastyfile.h"
+
+// Ranges shorter than this are read as part of one this long, so a read
+// that spoils a byte rarely spoils one of theirs.
+const size_t SHORT_READ = 64;
+
+// Reads of a chunk that have to agree before settle believes them.
+const unsigned int SETTLE_VOTES = 3;
+
+// Reads a source file one range at a time, so the client never needs
+// more than a few blocks of it in memory.
+//
+// With file nastiness 0 the file is mmapped and ranges are handed out
+// straight from the mapping. Otherwise every range is read twice through
+// NASTYFILE with different read sizes, and compared VERIFY_CHUNK bytes at a
+// time. A chunk the reads disagree on is read again, each time with a
+// different read size, until SETTLE_VOTES reads of it have the same CRC-32C.
+class FileReader
+{
+private:
+    string sourceName;
+    size_t sourceSize = 0;
+    NASTYFILE inputFile;
+    bool opened = false;
+    char *map = nullptr;
+    vector<char> scratch;
+    vector<char> reread;                            // one chunk and the bytes read around it
+    vector<pair<unsigned int, unsigned int>> votes; // each CRC-32C the chunk being settled has read as, and how often
+
+    bool readAt(size_t offset, char *dest, size_t len, size_t request);
+    void settle(size_t offset, char *dest, size_t len, const char *other);
+
+public:
+    FileReader(string dir, const char *fname, int filenast);
+    ~FileReader();
+
+    size_t size();
+    const char *read(size_t offset, size_t len, char *dest);
+    bool treeHash(unsigned char obuf[20]);
+};
+
+#endif
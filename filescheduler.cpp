@@ -0,0 +1,568 @@
+//
+//        filescheduler.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "filescheduler.h"
+#include "c150debug.h"
+#include "c150grading.h"
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+FileScheduler::FileScheduler(C150NastyDgmSocket *sock, WriteHelper *helper, string dir, int filenast)
+    : sock(sock), helper(helper), congestion(helper), dir(dir), filenast(filenast)
+{
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     add
+//
+//        queues a file in dir to be copied.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::add(const ScannedFile &file)
+{
+    pending.push_back(file);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     run
+//
+//    copies every queued file. Each time around we top up the files
+//    in flight, let each one send what it can, and then hand the next
+//    response from the server to whichever file it belongs to.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::run()
+{
+    char msg[512];
+    Clock::time_point lastHeard = Clock::now();
+
+    sort(pending.begin(), pending.end(), [](const ScannedFile &a, const ScannedFile &b) {
+        return a.size != b.size ? a.size > b.size : a.name < b.name;
+    });
+
+    while (true)
+    {
+        // Clean up files that are done, freeing their place for the next one.
+        for (unsigned int i = 0; i < active.size();)
+        {
+            if (active[i]->stage == FINISHED)
+            {
+                delete active[i]->sender;
+                delete active[i]->search;
+                delete active[i]->fetch;
+                delete active[i]->reader;
+                delete active[i];
+                active.erase(active.begin() + i);
+            }
+            else
+                i++;
+        }
+        if (pending.empty() && active.empty())
+            break;
+
+        while (active.size() < MAX_FILES_IN_FLIGHT && !pending.empty())
+            startNext();
+
+        // Files share the congestion window between them, each getting an even share.
+        size_t inFlight = 0;
+        unsigned int sending = 0;
+        for (unsigned int i = 0; i < active.size(); i++)
+        {
+            if (active[i]->stage == SENDING)
+            {
+                inFlight += size_t(active[i]->sender->inFlightCount()) * active[i]->layout.payload;
+                sending++;
+            }
+        }
+        size_t room = congestion.room(inFlight);
+        share = congestion.window() / max(1u, sending);
+        for (unsigned int i = 0; i < active.size(); i++)
+            pump(active[i], room);
+
+        // Wait no longer than the RTO, so timed out messages go out again on time,
+        // and only a moment while a file's hash or delta is on its way.
+        bool working = false, waiting = false;
+        for (unsigned int i = 0; i < active.size(); i++)
+        {
+            bool busy = active[i]->stage == HASHING || active[i]->stage == PLANNING;
+            working = working || busy;
+            waiting = waiting || (!busy && active[i]->stage != FINISHED);
+        }
+        int wait = max(1, int(std::chrono::duration_cast<std::chrono::milliseconds>(helper->rto()).count()));
+        if (working)
+            wait = min(wait, HASH_POLL_MS);
+        if (wait != readTimeout)
+        {
+            sock->turnOnTimeouts(wait);
+            readTimeout = wait;
+        }
+
+        ssize_t readlen = sock->read(msg, sizeof(msg));
+        if (sock->timedout() || readlen == 0)
+        {
+            // Nothing heard back; if the server stays quiet this long, give up.
+            // It can't be expected to say anything while every file is still hashing or planning.
+            if (!waiting)
+                lastHeard = Clock::now();
+            else if (Clock::now() - lastHeard >= NETWORK_TIMEOUT)
+                throw C150Exception("Network down.");
+            continue;
+        }
+
+        lastHeard = Clock::now();
+        handle(msg, readlen);
+    }
+
+    cout << "CONGESTION: window " << congestion.window() << " bytes, pacing "
+         << congestion.pacingRate() / 1e6 << " MB/s, " << congestion.losses() << " loss events, "
+         << congestion.lostPackets() << " packets lost, " << congestion.sentBytes() << " bytes sent, "
+         << congestion.ackedBytes() << " bytes acked" << endl;
+    cout << "CHECKS: " << sizer.checksDone() << " 'e' checks, " << sizer.checksFailed() << " failed, last covered "
+         << sizer.lastBlocks() << " blocks" << endl;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     startNext
+//
+//    Starts hashing the next file. pump sends the packet telling
+//    the server we are starting to send it, of type "s" filename
+//    fileSize, once the hash is ready.
+//
+//    The smallest file left goes first, so there's always one whose
+//    hash is ready in moments. Then the biggest file left goes next
+//    unless BIG_FILES_IN_FLIGHT already are, and then the smallest.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::startNext()
+{
+    unsigned int big = 0;
+    for (size_t i = 0; i < active.size(); i++)
+        big += active[i]->big;
+
+    Transfer *t = new Transfer;
+    t->big = big < active.size() && big < BIG_FILES_IN_FLIGHT;
+    if (t->big)
+    {
+        t->fname = pending.front().name;
+        pending.pop_front();
+    }
+    else
+    {
+        t->fname = pending.back().name;
+        pending.pop_back();
+    }
+
+    *GRADING << "File: " << t->fname << " beginning transmission" << endl;
+    cout << "STARTING FILE TRANSFER ON " << t->fname << endl;
+
+    // The file is read a few blocks at a time while it's sent, never all at once.
+    // Its hash goes first, so the server can say if it has the file already. That
+    // means reading the whole file, so it's done on another thread, and the other
+    // files keep going meanwhile.
+    t->reader = new FileReader(dir, t->fname.c_str(), filenast);
+    t->hashed = async(launch::async, [t]() { return t->reader->treeHash(t->obuf); });
+    active.push_back(t);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     startSending
+//
+//    (re)starts sending a file's data from the beginning. When a
+//    MerkleSearch has finished, only the blocks it found are sent.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::startSending(Transfer *t)
+{
+    delete t->sender;
+    t->sender = new FileSender(sock, helper, &congestion, &sizer, t->fileId, t->digest, t->codec, t->layout, t->reader, t->fname.c_str());
+    t->stage = SENDING;
+    t->transmissionAttempt++;
+
+    if (t->search == nullptr)
+    {
+        t->sender->copyFrom(t->copyFrom);
+        if (t->resumeBlock > 0)
+            t->sender->resumeFrom(t->resumeBlock);
+        return;
+    }
+
+    // If the tree agrees with the server after all, check every block.
+    vector<unsigned int> repairBlocks = t->search->mismatched();
+    if (repairBlocks.empty())
+    {
+        for (unsigned int b = 0; b < t->roots.size(); b++)
+            repairBlocks.push_back(b);
+    }
+    cout << "File: " << t->fname << " repairing " << repairBlocks.size() << " of " << t->roots.size() << " blocks." << endl;
+    t->sender->repairOnly(repairBlocks);
+    delete t->search;
+    t->search = nullptr;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     startRepair
+//
+//    after a failed file check, searches the file's Merkle tree for
+//    the blocks that differ instead of sending the whole file again.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::startRepair(Transfer *t)
+{
+    if (t->roots.empty())
+    {
+        startSending(t);
+        return;
+    }
+
+    t->search = new MerkleSearch(t->fileId, t->roots, MERKLE_BLOCK_LEVEL, 0, merkleRootLevel(t->roots.size()), 0);
+    t->stage = REPAIRING;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     pump
+//
+//    sends a file's 's' once its hash is ready, starts its data once
+//    its delta is planned, lets a file's sender use up to room bytes
+//    of the shared window, and no more than its share of the whole
+//    window in flight, and resends its control message if the
+//    response is overdue.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::pump(Transfer *t, size_t &room)
+{
+    if (t->stage == HASHING)
+    {
+        // The server hears about the file once its hash is ready.
+        if (t->hashed.wait_for(std::chrono::seconds(0)) != future_status::ready)
+            return;
+        if (!t->hashed.get())
+        {
+            *GRADING << "File: " << t->fname << " could not be hashed, skipping" << endl;
+            cerr << "File: " << t->fname << " could not be hashed, skipping." << endl;
+            t->stage = FINISHED;
+            return;
+        }
+        t->stage = STARTING;
+        sendControl(t);
+        return;
+    }
+
+    if (t->stage == SENDING)
+    {
+        unsigned int before = t->sender->inFlightCount();
+        size_t mine = size_t(before) * t->layout.payload;
+        size_t allowed = mine < share ? min(room, share - mine) : 0;
+        t->sender->pump((allowed + t->layout.payload - 1) / t->layout.payload);
+        unsigned int after = t->sender->inFlightCount();
+        if (after > before)
+            room -= min(room, size_t(after - before) * t->layout.payload);
+        if (!t->sender->done())
+            return;
+
+        // The sender built the Merkle roots as it read the file. A repair only read
+        // part of it, so the roots from the first time around still stand.
+        if (t->roots.empty())
+            t->roots = t->sender->roots();
+        t->stage = FINISHING;
+        *GRADING << "File: " << t->fname << " transmission complete, waiting for end-to-end check, attempt "
+                 << t->transmissionAttempt << endl;
+        sendControl(t);
+        return;
+    }
+
+    if (t->stage == SIGNING)
+    {
+        t->fetch->pump(sock, helper);
+        if (!t->fetch->done())
+            return;
+
+        // Work out what the server already has. That means reading the whole
+        // file again, so like its hash it's done on another thread.
+        t->planned = async(launch::async, [t]() {
+            return planDelta(t->reader, t->fetch->signatures(), t->layout.payload, t->copyFrom);
+        });
+        t->stage = PLANNING;
+        return;
+    }
+
+    if (t->stage == PLANNING)
+    {
+        // Then send the rest.
+        if (t->planned.wait_for(std::chrono::seconds(0)) != future_status::ready)
+            return;
+        unsigned int copies = t->planned.get();
+        cout << "File: " << t->fname << " server can copy " << copies << " of " << t->copyFrom.size()
+             << " packets from its old copy." << endl;
+        delete t->fetch;
+        t->fetch = nullptr;
+        startSending(t);
+        return;
+    }
+
+    if (t->stage == REPAIRING)
+    {
+        t->search->pump(sock, helper, helper->rto());
+        if (t->search->done())
+            startSending(t);
+        return;
+    }
+
+    // Each resend of the same message waits twice as long as the one before.
+    if (t->stage != FINISHED && Clock::now() - t->sentAt >= helper->rto(t->resends))
+        sendControl(t, true);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     sendControl
+//
+//        sends the control message for the stage a file is in, and
+//        counts resends of it so each one waits longer.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::sendControl(Transfer *t, bool resend)
+{
+    switch (t->stage)
+    {
+    case STARTING:
+    {
+        // We send the length of the file so the server knows when to stop accepting packets.
+        StartPacket pckt;
+        pckt.cmd = 's';
+        pckt.fileSz = t->reader->size();
+        pckt.digest = PREFERRED_DIGEST;
+        pckt.payload = PREFERRED_PAYLOAD;
+        pckt.codec = PREFERRED_CODEC;
+        memcpy(pckt.hash, t->obuf, sizeof(pckt.hash));
+        strcpy(pckt.name, t->fname.c_str());
+        helper->sendMsg(sock, pckt);
+        break;
+    }
+    case FINISHING:
+    {
+        // Ask for the server's hash of the file corresponding to file ID
+        EndToEndPacket pckt;
+        memset(&pckt, 0, sizeof(pckt));
+        pckt.cmd = 'f';
+        pckt.fileId = t->fileId;
+        pckt.packetId = 0;
+        pckt.count = 0;
+        helper->sendMsg(sock, pckt);
+        break;
+    }
+    case CONFIRMING:
+    {
+        // Tell the server we acknowledge the result of the end-to-end check
+        ConfirmPacket pckt;
+        pckt.cmd = 'c';
+        pckt.success = t->endCheck;
+        strcpy(pckt.name, t->fname.c_str());
+        helper->sendMsg(sock, pckt);
+        break;
+    }
+    default:
+        return;
+    }
+
+    t->resends = resend ? t->resends + 1 : 0;
+    t->sentAt = Clock::now();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     handle
+//
+//    processes one response from the server, moving its file on to
+//    the next stage when it's the one that file was waiting for.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileScheduler::handle(const char *msg, ssize_t len)
+{
+    switch (msg[0])
+    {
+    case 's':
+    {
+        if (len < (ssize_t)sizeof(StartResponsePacket))
+            break;
+        StartResponsePacket pckt = *(reinterpret_cast<const StartResponsePacket *>(msg));
+        pckt.name[sizeof(pckt.name) - 1] = '\0';
+        Transfer *t = byName(pckt.name, STARTING);
+        if (t == nullptr || pckt.fileSz != t->reader->size())
+            break;
+
+        // A file the server won't take can't be copied, so on to the next one.
+        if (pckt.refused)
+        {
+            *GRADING << "File: " << t->fname << " refused by the server, skipping" << endl;
+            cerr << "File: " << t->fname << " refused by the server, skipping." << endl;
+            t->stage = FINISHED;
+            break;
+        }
+
+        // Nothing to do for a file the server already has, so on to the next one.
+        if (pckt.identical)
+        {
+            *GRADING << "File: " << t->fname << " already on the server with the same hash, skipping" << endl;
+            cout << "File: " << t->fname << " unchanged on the server, skipping." << endl;
+            t->stage = FINISHED;
+            break;
+        }
+
+        if (!knownDigest(pckt.digest) || pckt.payload < (unsigned int)SEND_SIZE || pckt.payload > PREFERRED_PAYLOAD)
+            break;
+
+        // From here on the server knows this file by the id it picked,
+        // and checks its blocks with the digest, packet size and codec it picked.
+        t->fileId = pckt.fileId;
+        t->digest = pckt.digest;
+        t->codec = knownCodec(pckt.codec) ? pckt.codec : CODEC_NONE;
+        t->resumeBlock = pckt.resumeBlock;
+        t->layout = makeLayout(pckt.payload);
+        cout << "BEGINNING TRANSMISSION OF " << t->fname << endl;
+
+        // If the server has an old copy with whole pieces in it, only send what changed.
+        if (pckt.baseSize >= t->layout.payload && t->reader->size() >= t->layout.payload)
+        {
+            t->fetch = new SignatureFetch(t->fileId, pckt.baseSize / t->layout.payload);
+            t->stage = SIGNING;
+            break;
+        }
+        startSending(t);
+        break;
+    }
+    case 'g':
+    {
+        // signatures of the server's old copy of a file
+        if (len < (ssize_t)sizeof(SignatureResponsePacket))
+            break;
+        SignatureResponsePacket pckt = *(reinterpret_cast<const SignatureResponsePacket *>(msg));
+        Transfer *t = byId(pckt.fileId, SIGNING);
+        if (t != nullptr && pckt.count <= SIGNATURE_BATCH)
+            t->fetch->handle(pckt);
+        break;
+    }
+    case 'e':
+    {
+        // block checks, which the file's window deals with
+        if (len < (ssize_t)sizeof(EndToEndResponsePacket))
+            break;
+        EndToEndResponsePacket pckt = *(reinterpret_cast<const EndToEndResponsePacket *>(msg));
+        Transfer *t = byId(pckt.fileId, SENDING);
+        if (t != nullptr)
+            t->sender->handle(msg, len);
+        break;
+    }
+    case 'm':
+    {
+        // Merkle digests, for a file's search or one of its blocks'
+        if (len < (ssize_t)sizeof(MerkleResponsePacket))
+            break;
+        MerkleResponsePacket pckt = *(reinterpret_cast<const MerkleResponsePacket *>(msg));
+        Transfer *t = byId(pckt.fileId, REPAIRING);
+        if (t != nullptr)
+            t->search->handle(pckt);
+        else if ((t = byId(pckt.fileId, SENDING)) != nullptr)
+            t->sender->handle(msg, len);
+        break;
+    }
+    case 'a':
+    {
+        // a batch of data acks, each passed to the file it's for
+        if (len < (ssize_t)offsetof(AckPacket, acks))
+            break;
+        const AckPacket *pckt = reinterpret_cast<const AckPacket *>(msg);
+        congestion.dataLost(pckt->lost);
+        unsigned int count = min((size_t)pckt->count, (len - offsetof(AckPacket, acks)) / sizeof(AckRecord));
+        for (unsigned int i = 0; i < count && i < ACK_BATCH; i++)
+        {
+            Transfer *t = byId(pckt->acks[i].fileId, SENDING);
+            if (t != nullptr)
+                t->sender->ackPacket(pckt->acks[i].packetId);
+        }
+        break;
+    }
+    case 'f':
+    {
+        if (len < (ssize_t)sizeof(EndToEndResponsePacket))
+            break;
+        EndToEndResponsePacket pckt = *(reinterpret_cast<const EndToEndResponsePacket *>(msg));
+        Transfer *t = byId(pckt.fileId, FINISHING);
+        if (t == nullptr)
+            break;
+
+        // checking if our hash and server's hash are equal.
+        t->endCheck = memcmp(t->obuf, pckt.obuf, 20) == 0;
+        t->stage = CONFIRMING;
+        sendControl(t);
+        break;
+    }
+    case 'c':
+    {
+        if (len < (ssize_t)sizeof(ConfirmPacket))
+            break;
+        ConfirmPacket pckt = *(reinterpret_cast<const ConfirmPacket *>(msg));
+        pckt.name[sizeof(pckt.name) - 1] = '\0';
+        Transfer *t = byName(pckt.name, CONFIRMING);
+        if (t == nullptr || pckt.success != t->endCheck)
+            break;
+
+        if (t->endCheck)
+        {
+            *GRADING << "File: " << t->fname << " end-to-end check succeeded, attempt " << t->transmissionAttempt << endl;
+            cout << "File: " << t->fname << " transmission complete." << endl;
+            t->stage = FINISHED;
+        }
+        else
+        {
+            // Keep on repairing the file until end-to-end check succeeds.
+            *GRADING << "File: " << t->fname << " end-to-end check failed, attempt " << t->transmissionAttempt << endl;
+            startRepair(t);
+        }
+        break;
+    }
+    default:
+    {
+        break;
+    }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     byName / byId
+//
+//    find the file in flight a response is for, as long as it's in
+//    the stage that response answers. Otherwise it's a stale repeat.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+Transfer *FileScheduler::byName(const char *name, TransferStage stage)
+{
+    for (unsigned int i = 0; i < active.size(); i++)
+    {
+        if (active[i]->stage == stage && active[i]->fname == name)
+            return active[i];
+    }
+    return nullptr;
+}
+
+Transfer *FileScheduler::byId(unsigned int fileId, TransferStage stage)
+{
+    for (unsigned int i = 0; i < active.size(); i++)
+    {
+        if (active[i]->stage == stage && active[i]->fileId == fileId)
+            return active[i];
+    }
+    return nullptr;
+}
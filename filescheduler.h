@@ -0,0 +1,105 @@
+//
+//        filescheduler.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef FILESCHEDULER_H
+#define FILESCHEDULER_H
+
+#include "filehelper.h"
+#include "filereader.h"
+#include "filesender.h"
+#include "dirscan.h"
+#include <deque>
+#include <future>
+
+// Most files we have between 's' and a successful 'c' at once.
+const unsigned int MAX_FILES_IN_FLIGHT = 8;
+
+// Of those, most that are taken biggest first. The rest, and always the
+// first, go to the smallest files left, whose round trips then overlap the
+// big files' data.
+const unsigned int BIG_FILES_IN_FLIGHT = 2;
+
+// How long the server may stay silent before we give up on it.
+const Clock::duration NETWORK_TIMEOUT = std::chrono::seconds(10);
+
+// Longest the socket waits on a read while a file is being hashed or its
+// delta planned, so what comes next goes out soon after it's ready.
+const int HASH_POLL_MS = 5;
+
+// Where a file is in the protocol. Each stage waits on one kind of response.
+enum TransferStage
+{
+    HASHING,    // hashing the file on another thread, nothing sent yet
+    STARTING,   // 's' sent, waiting for the server's fileId
+    SIGNING,    // fetching the signatures of the server's old copy with a SignatureFetch
+    PLANNING,   // matching the file against those signatures on another thread
+    SENDING,    // data going through the FileSender
+    FINISHING,  // 'f' sent, waiting for the server's hash of the file
+    CONFIRMING, // 'c' sent, waiting for it to be echoed back
+    REPAIRING,  // the file check failed, finding the bad blocks with a MerkleSearch
+    FINISHED
+};
+
+// One file being copied.
+struct Transfer
+{
+    string fname;
+    bool big = false; // taken from the big end of the queue
+    TransferStage stage = HASHING;
+    unsigned int fileId = 0;
+    unsigned char digest = DIGEST_SHA1; // block digest the server agreed to
+    unsigned char codec = CODEC_NONE;   // block codec the server agreed to
+    unsigned int resumeBlock = 0;       // blocks the server verified before it was cut short
+    Layout layout;                      // packet and block sizes the server agreed to
+    FileReader *reader = nullptr;
+    FileSender *sender = nullptr;
+    MerkleSearch *search = nullptr;
+    SignatureFetch *fetch = nullptr;
+    vector<uint64_t> copyFrom; // where each packet is in the server's old copy, from planDelta
+    vector<unsigned int> roots; // Merkle root of each block, from the first full send
+    unsigned char obuf[20];     // TreeHash of the whole file, sent with 's' and checked by 'f'
+    future<bool> hashed;        // ready once obuf is, false if it couldn't be worked out
+    future<unsigned int> planned; // ready once copyFrom is, with how many packets it copies
+    bool endCheck = false;  // result of the last 'f' check
+    int transmissionAttempt = 0;
+    Clock::time_point sentAt; // when the last control message went out
+    unsigned int resends = 0; // times the last control message has gone out again
+};
+
+// Copies a list of files over one socket, keeping up to MAX_FILES_IN_FLIGHT
+// of them going at once, in an order picked from their sizes. Every response is handed to the transfer it's for,
+// by name for 's' and 'c' and by fileId for everything else.
+class FileScheduler
+{
+private:
+    C150NastyDgmSocket *sock;
+    WriteHelper *helper;
+    CongestionControl congestion; // shared by every file's data packets
+    CheckSizer sizer;             // shared by every file's 'e' checks
+    string dir;
+    int filenast;
+    deque<ScannedFile> pending; // biggest first once run starts
+    vector<Transfer *> active;
+    int readTimeout = -1; // milliseconds the socket currently waits on a read
+    size_t share = 0;     // bytes of the congestion window each sending file may use
+
+    void startNext();
+    void startSending(Transfer *t);
+    void startRepair(Transfer *t);
+    void pump(Transfer *t, size_t &room);
+    void sendControl(Transfer *t, bool resend = false);
+    void handle(const char *msg, ssize_t len);
+    Transfer *byName(const char *name, TransferStage stage);
+    Transfer *byId(unsigned int fileId, TransferStage stage);
+
+public:
+    FileScheduler(C150NastyDgmSocket *sock, WriteHelper *helper, string dir, int filenast);
+
+    void add(const ScannedFile &file);
+    void run();
+};
+
+#endif
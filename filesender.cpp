@@ -0,0 +1,842 @@
+//
+//        filesender.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "filesender.h"
+#include "c150debug.h"
+#include "c150grading.h"
+#include <cstring>
+#include <cmath>
+#include <zlib.h>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     FileSender
+//
+//        sets up the window state for a file read through reader.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+FileSender::FileSender(C150NastyDgmSocket *sock, WriteHelper *helper, CongestionControl *congestion, CheckSizer *sizer, unsigned int fileId,
+                       unsigned char digest, unsigned char codec, Layout layout, FileReader *reader, const char *fname)
+    : sock(sock), helper(helper), congestion(congestion), sizer(sizer), fileId(fileId), digest(digest), codec(codec), layout(layout), reader(reader), sourceSize(reader->size()), fname(fname)
+{
+    // Calculate number of packets to send.
+    ttlPackets = sourceSize / layout.payload;
+    if (sourceSize % layout.payload != 0)
+        ttlPackets++;
+
+    // Only packets of blocks in the window have any state, so it's kept in a ring.
+    packets.assign(BLOCK_WINDOW * layout.blockPackets, UNSENT);
+    lastSent.resize(BLOCK_WINDOW * layout.blockPackets);
+    resent.resize(BLOCK_WINDOW * layout.blockPackets);
+    copied.resize(BLOCK_WINDOW * layout.blockPackets);
+
+    // Split the packets into blocks of blockPackets packets, each its own check until formCheck says otherwise.
+    unsigned int ttlBlocks = ttlPackets / layout.blockPackets;
+    if (ttlPackets % layout.blockPackets != 0)
+        ttlBlocks++;
+
+    blocks.resize(ttlBlocks);
+    for (unsigned int b = 0; b < ttlBlocks; b++)
+    {
+        blocks[b].firstPacket = b * layout.blockPackets;
+        blocks[b].numPackets = min(layout.blockPackets, ttlPackets - b * layout.blockPackets);
+        blocks[b].check = b;
+    }
+
+    blockRoots.assign(ttlBlocks, 0);
+    window.resize(min(size_t(BLOCK_WINDOW), blocks.size()) * layout.blockBytes());
+    if (codec == CODEC_ZLIB)
+    {
+        packedSlot = compressBound(layout.blockBytes());
+        packedWindow.resize(min(size_t(BLOCK_WINDOW), blocks.size()) * packedSlot);
+    }
+}
+
+FileSender::~FileSender()
+{
+    for (unsigned int b = 0; b < blocks.size(); b++)
+        delete blocks[b].search;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     repairOnly
+//
+//    after a failed file check, sends only the blocks in repairBlocks.
+//    The server already has every packet, so each of those starts with
+//    an 'e' check, and only what that turns up gets sent again.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::repairOnly(const vector<unsigned int> &repairBlocks)
+{
+    repairing = true;
+    for (unsigned int b = 0; b < blocks.size(); b++)
+        blocks[b].verified = true;
+    for (unsigned int i = 0; i < repairBlocks.size(); i++)
+    {
+        if (repairBlocks[i] < blocks.size())
+            blocks[repairBlocks[i]].verified = false;
+    }
+
+    while (baseBlock < blocks.size() && blocks[baseBlock].verified)
+        baseBlock++;
+    nextPacket = min(ttlPackets, baseBlock * layout.blockPackets);
+}
+
+// where each packet starts in the server's old copy, or NO_COPY
+void FileSender::copyFrom(const vector<uint64_t> &copyFrom)
+{
+    if (copyFrom.size() == ttlPackets)
+        copies = copyFrom;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     resumeFrom
+//
+//    starts at block, since the server has every block before it
+//    from a transfer that was cut short, and has checked them.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::resumeFrom(unsigned int block)
+{
+    block = min(block, (unsigned int)blocks.size());
+    for (unsigned int b = 0; b < block; b++)
+        blocks[b].verified = true;
+    baseBlock = nextCheck = block;
+    nextPacket = min(ttlPackets, block * layout.blockPackets);
+}
+
+// Merkle digest of every block, once the sender is done.
+const vector<unsigned int> &FileSender::roots()
+{
+    return blockRoots;
+}
+
+// Index of a packet's state in the window, which reuses its slots in turn.
+unsigned int FileSender::slot(unsigned int packetId)
+{
+    return packetId % (BLOCK_WINDOW * layout.blockPackets);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     done
+//
+//        true once every block has passed its 'e' check.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileSender::done()
+{
+    return baseBlock == blocks.size();
+}
+
+unsigned int FileSender::inFlightCount()
+{
+    return outstanding;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     pump
+//
+//    queues timed out packets and checks for resending, then
+//    fills the window with queued packets first and new ones after.
+//    sends at most room data packets, so several files can share a window.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::pump(unsigned int room)
+{
+    Clock::time_point now = Clock::now();
+    Clock::duration rto = helper->rto();
+    bool timedOut = false;
+    unsigned int lost = 0;
+
+    // inFlight is in send order, so we only look at the front. Entries for packets
+    // that were acked or sent again since are stale and just get dropped.
+    while (!inFlight.empty())
+    {
+        SentPacket &front = inFlight.front();
+        if (front.packetId < baseBlock * layout.blockPackets || packets[slot(front.packetId)] != IN_FLIGHT ||
+            lastSent[slot(front.packetId)] != front.sentAt)
+        {
+            inFlight.pop_front();
+        }
+        else if (now - front.sentAt >= rto)
+        {
+            if (!copied[slot(front.packetId)])
+            {
+                outstanding--;
+                lost++;
+            }
+            packets[slot(front.packetId)] = QUEUED;
+            resend.push_back(front.packetId);
+            inFlight.pop_front();
+            timedOut = true;
+        }
+        else
+            break;
+    }
+
+    // Resend any 'e' checks whose response never came back, and keep Merkle searches going.
+    for (unsigned int b = baseBlock; b < blocks.size() && b < baseBlock + BLOCK_WINDOW; b++)
+    {
+        if (blocks[b].checkSent && !blocks[b].verified && now - blocks[b].checkSentAt >= rto)
+        {
+            sendCheck(b);
+            timedOut = true;
+        }
+        if (blocks[b].search != nullptr)
+        {
+            blocks[b].search->pump(sock, helper, rto);
+            if (blocks[b].search->done())
+                finishSearch(b);
+        }
+    }
+
+    // Timeouts back the RTO off until an ack brings a fresh sample,
+    // and lost packets shrink the congestion window.
+    if (timedOut)
+        helper->backoff();
+    if (lost > 0)
+        congestion->lost(lost);
+
+    // Copies take no room, since they carry no data.
+    while (room > 0 && outstanding < WINDOW_SIZE)
+    {
+        if (!resend.empty())
+        {
+            unsigned int packetId = resend.front();
+            resend.pop_front();
+            // might have been acked by a late response while it was queued
+            if (packetId >= baseBlock * layout.blockPackets && packets[slot(packetId)] == QUEUED)
+            {
+                if (copyRun(packetId) > 0)
+                {
+                    sendCopy(packetId, 1);
+                    continue;
+                }
+                sendPacket(packetId);
+            }
+            room--;
+        }
+        else if (nextPacket < ttlPackets && nextPacket / layout.blockPackets < baseBlock + BLOCK_WINDOW)
+        {
+            unsigned int block = nextPacket / layout.blockPackets;
+            if (repairing)
+            {
+                // Repairs skip straight to the check; the packets count as acked.
+                if (!blocks[block].verified)
+                {
+                    loadBlock(block);
+                    for (unsigned int i = blocks[block].firstPacket; i < blocks[block].firstPacket + blocks[block].numPackets; i++)
+                        packets[slot(i)] = ACKED;
+                    blocks[block].acked = blocks[block].numPackets;
+                    sendCheck(block);
+                }
+                nextPacket = min(ttlPackets, (block + 1) * layout.blockPackets);
+                room--;
+                continue;
+            }
+
+            if (nextPacket % layout.blockPackets == 0)
+            {
+                if (block == nextCheck)
+                    formCheck(block);
+                loadBlock(block);
+            }
+
+            unsigned int run = copyRun(nextPacket);
+            if (run > 0)
+            {
+                sendCopy(nextPacket, run);
+                nextPacket += run;
+                continue;
+            }
+            sendPacket(nextPacket++);
+            room--;
+
+            // A group's parity follows its last packet. The packets
+            // a compressed block saved were never needed.
+            BlockState &state = blocks[block];
+            unsigned int members = state.packed > 0 ? pieces(state) : state.numPackets;
+            unsigned int sent = nextPacket - state.firstPacket;
+            if (state.fecGroup > 0 && (sent % state.fecGroup == 0 || sent == members))
+            {
+                unsigned int first = (sent - 1) / state.fecGroup * state.fecGroup;
+                sendParity(block, first, sent - first);
+            }
+            if (state.packed > 0 && sent == members)
+                nextPacket = state.firstPacket + state.numPackets;
+        }
+        else
+            break;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     handle
+//
+//        processes one response from the server.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::handle(const char *msg, ssize_t len)
+{
+    switch (msg[0])
+    {
+    case 'e':
+    {
+        if (len < (ssize_t)sizeof(EndToEndResponsePacket))
+            break;
+        EndToEndResponsePacket pckt = *(reinterpret_cast<const EndToEndResponsePacket *>(msg));
+        if (pckt.fileId == fileId)
+            checkBlock(pckt);
+        break;
+    }
+    case 'm':
+    {
+        // digests for a block's Merkle search
+        if (len < (ssize_t)sizeof(MerkleResponsePacket))
+            break;
+        MerkleResponsePacket pckt = *(reinterpret_cast<const MerkleResponsePacket *>(msg));
+        if (pckt.fileId != fileId || pckt.level >= MERKLE_BLOCK_LEVEL)
+            break;
+        size_t block = (size_t(pckt.first) << pckt.level) / MERKLE_BLOCK_SLOTS;
+        if (block < blocks.size() && blocks[block].search != nullptr)
+            blocks[block].search->handle(pckt);
+        break;
+    }
+    default:
+    {
+        // stale response to an earlier control message, nothing to do
+        break;
+    }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     loadBlock
+//
+//    reads a block into its window slot as it enters the window.
+//    blocks come in order exactly once, so this is also where the
+//    block's check hash and its Merkle root get computed, and where
+//    it gets compressed.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::loadBlock(unsigned int block)
+{
+    BlockState &state = blocks[block];
+    size_t start = size_t(state.firstPacket) * layout.payload;
+    size_t bytes = min(layout.blockBytes(), sourceSize - start);
+
+    // the block that used to be in this slot is verified, or it would still be in the window
+    char *dest = window.data() + (block % BLOCK_WINDOW) * layout.blockBytes();
+    state.data = reader->read(start, bytes, dest);
+
+    for (unsigned int i = state.firstPacket; i < state.firstPacket + state.numPackets; i++)
+        packets[slot(i)] = UNSENT;
+
+    blockDigest(digest, state.data, bytes, state.obuf);
+
+    vector<unsigned int> leaves;
+    leafDigests(state.data, bytes, layout.payload, leaves);
+    blockRoots[block] = merkleNode(leaves.data(), leaves.size(), MERKLE_BLOCK_LEVEL, 0);
+
+    if (codec == CODEC_ZLIB && !repairing)
+        packBlock(block, bytes);
+    state.fecGroup = repairing || hasCopies(block) ? 0 : fecGroup();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     packBlock
+//
+//    compresses a block into its slot of packedWindow, and keeps it
+//    if it fits in fewer packets. The packets it saves are marked
+//    acked. Blocks the server can copy aren't worth compressing, and
+//    after one that didn't compress, the next few aren't tried.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::packBlock(unsigned int block, size_t bytes)
+{
+    BlockState &state = blocks[block];
+    state.packed = 0;
+    if (state.numPackets < 2 || hasCopies(block))
+        return;
+    if (skipPacking > 0)
+    {
+        skipPacking--;
+        return;
+    }
+
+    char *dest = packedWindow.data() + (block % BLOCK_WINDOW) * packedSlot;
+    uLongf len = packedSlot;
+    if (compress2(reinterpret_cast<Bytef *>(dest), &len, reinterpret_cast<const Bytef *>(state.data), bytes, COMPRESSION_LEVEL) != Z_OK ||
+        (len + layout.payload - 1) / layout.payload >= state.numPackets)
+    {
+        packingBackoff = min(PACKING_BACKOFF, max(1u, packingBackoff * 2));
+        skipPacking = packingBackoff;
+        return;
+    }
+
+    packingBackoff = 0;
+    state.packed = len;
+    state.packedData = dest;
+    for (unsigned int i = state.firstPacket + pieces(state); i < state.firstPacket + state.numPackets; i++)
+    {
+        packets[slot(i)] = ACKED;
+        state.acked++;
+    }
+}
+
+// true if the server can copy any packet of block from its old copy
+bool FileSender::hasCopies(unsigned int block)
+{
+    for (unsigned int i = blocks[block].firstPacket; !copies.empty() && i < blocks[block].firstPacket + blocks[block].numPackets; i++)
+    {
+        if (copies[i] != NO_COPY)
+            return true;
+    }
+    return false;
+}
+
+// packets the compressed bytes of a block fill
+unsigned int FileSender::pieces(const BlockState &state)
+{
+    return (state.packed + layout.payload - 1) / layout.payload;
+}
+
+// bytes of data a packet carries: a piece of its compressed block the
+// first time around, or the file's own bytes
+size_t FileSender::wireBytes(unsigned int packetId)
+{
+    BlockState &state = blocks[packetId / layout.blockPackets];
+    if (state.packed > 0 && state.attempts == 1)
+        return min(size_t(layout.payload), state.packed - size_t(packetId - state.firstPacket) * layout.payload);
+    return min(size_t(layout.payload), sourceSize - size_t(packetId) * layout.payload);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     sendPacket
+//
+//        copies one packet's bytes out of its block and sends it.
+//        A block that failed a check goes raw even if it compressed.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::sendPacket(unsigned int packetId)
+{
+    BlockState &state = blocks[packetId / layout.blockPackets];
+    size_t offset = size_t(packetId - state.firstPacket) * layout.payload;
+    // Logic to handle if we want to send last x bytes, and x is less than the payload.
+    size_t num = wireBytes(packetId);
+    bool packed = state.packed > 0 && state.attempts == 1;
+    memcpy(packet.bytes, (packed ? state.packedData : state.data) + offset, num);
+    packet.packed = packed ? state.packed : 0;
+    packet.resent = packets[slot(packetId)] == QUEUED;
+    packet.fileId = fileId;
+    packet.offset = uint64_t(packetId) * layout.payload;
+    packet.repair = state.attempts > 1;
+    packet.checksum = packetChecksum(packet, num);
+    helper->sendMsg(sock, packet, num);
+    congestion->sent(num);
+    markSent(packetId, false);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     fecGroup / sendParity
+//
+//    packets per parity packet for a block about to be sent, from the
+//    loss rate, and the parity of count of a block's packets from
+//    first. Only the first one of a group can be longer than the rest.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int FileSender::fecGroup()
+{
+    double loss = congestion->lossRate();
+    if (loss < FEC_MIN_LOSS)
+        return 0;
+    return max(1u, min(layout.blockPackets, (unsigned int)(FEC_TARGET / loss)));
+}
+
+void FileSender::sendParity(unsigned int block, unsigned int first, unsigned int count)
+{
+    BlockState &state = blocks[block];
+    bool packed = state.packed > 0 && state.attempts == 1;
+    const char *data = packed ? state.packedData : state.data;
+    size_t len = wireBytes(state.firstPacket + first);
+
+    memset(parity.bytes, 0, len);
+    for (unsigned int k = first; k < first + count; k++)
+        xorBytes(parity.bytes, data + size_t(k) * layout.payload, wireBytes(state.firstPacket + k));
+
+    parity.cmd = 'x';
+    parity.fileId = fileId;
+    parity.offset = uint64_t(state.firstPacket + first) * layout.payload;
+    parity.packed = packed ? state.packed : 0;
+    parity.group = count;
+    parity.checksum = packetChecksum(parity, len);
+    helper->sendMsg(sock, parity, len);
+    congestion->sent(len, false);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     copyRun
+//
+//    how many packets from packetId on, within its block, the server
+//    can copy from one run of its old copy. 0 if packetId has to go
+//    as data, which it always does once its block has failed a check.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int FileSender::copyRun(unsigned int packetId)
+{
+    BlockState &state = blocks[packetId / layout.blockPackets];
+    if (copies.empty() || copies[packetId] == NO_COPY || state.attempts > 1)
+        return 0;
+
+    unsigned int run = 1;
+    while (packetId + run < state.firstPacket + state.numPackets &&
+           copies[packetId + run] == copies[packetId] + uint64_t(run) * layout.payload)
+        run++;
+    return run;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     sendCopy / markSent
+//
+//    sends one 'd' copy for count packets from packetId, and puts a
+//    packet in flight, however it went out.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::sendCopy(unsigned int packetId, unsigned int count)
+{
+    CopyPacket pckt;
+    pckt.cmd = 'd';
+    pckt.fileId = fileId;
+    pckt.packetId = packetId;
+    pckt.count = count;
+    pckt.base = copies[packetId];
+    helper->sendMsg(sock, pckt);
+
+    for (unsigned int i = packetId; i < packetId + count; i++)
+        markSent(i, true);
+}
+
+void FileSender::markSent(unsigned int packetId, bool copy)
+{
+    resent[slot(packetId)] = packets[slot(packetId)] == QUEUED;
+    copied[slot(packetId)] = copy;
+    packets[slot(packetId)] = IN_FLIGHT;
+    lastSent[slot(packetId)] = Clock::now();
+    inFlight.push_back({packetId, lastSent[slot(packetId)]});
+    if (!copy)
+        outstanding++;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     formCheck
+//
+//    makes block the first of a new check, as big as the CheckSizer
+//    says. A check never takes more than half the window, so older
+//    checks can always pass and make room for the rest of it.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::formCheck(unsigned int block)
+{
+    unsigned int most = max(1u, min(BLOCK_WINDOW / 2, (unsigned int)CHECK_SIZE / layout.blockPackets));
+    unsigned int span = min(sizer->blocks(most), (unsigned int)blocks.size() - block);
+
+    blocks[block].span = span;
+    for (unsigned int b = block; b < block + span; b++)
+        blocks[b].check = block;
+    nextCheck = block + span;
+}
+
+// packets in the check that starts at block
+unsigned int FileSender::checkPackets(unsigned int block)
+{
+    unsigned int count = 0;
+    for (unsigned int b = block; b < block + blocks[block].span; b++)
+        count += blocks[b].numPackets;
+    return count;
+}
+
+// our digest of the check that starts at block
+void FileSender::checkHash(unsigned int block, unsigned char obuf[20])
+{
+    vector<Hash> digests(blocks[block].span);
+    for (unsigned int b = block; b < block + blocks[block].span; b++)
+        memcpy(digests[b - block].obuf, blocks[b].obuf, 20);
+    checkDigest(digest, digests, obuf);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     sendCheck
+//
+//    sends the 'e' check that starts at block, once every packet
+//    in it is acked. The server is told exactly which packets it covers.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::sendCheck(unsigned int block)
+{
+    BlockState &state = blocks[block];
+
+    EndToEndPacket pckt;
+    pckt.cmd = 'e';
+    pckt.fileId = fileId;
+    pckt.packetId = state.firstPacket;
+    pckt.count = checkPackets(block);
+    checkHash(block, pckt.obuf);
+    helper->sendMsg(sock, pckt);
+
+    state.checkSent = true;
+    state.checkSentAt = Clock::now();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     ackPacket
+//
+//    marks a packet acked, and checks its block once it is complete.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::ackPacket(unsigned int packetId)
+{
+    // Duplicate acks, or acks for packets we never sent, are ignored.
+    if (packetId < baseBlock * layout.blockPackets || packetId >= nextPacket)
+        return;
+    if (packets[slot(packetId)] != IN_FLIGHT && packets[slot(packetId)] != QUEUED)
+        return;
+    if (blocks[packetId / layout.blockPackets].verified) // its slot belongs to another block now
+        return;
+
+    // Copies are RTT samples too, or a file that's mostly copies would never bring a backed off RTO down.
+    if (packets[slot(packetId)] == IN_FLIGHT)
+    {
+        if (!copied[slot(packetId)])
+            outstanding--;
+        if (!resent[slot(packetId)])
+            helper->rttSample(Clock::now() - lastSent[slot(packetId)]);
+    }
+    packets[slot(packetId)] = ACKED;
+    if (!copied[slot(packetId)])
+        congestion->acked(wireBytes(packetId), layout.payload);
+
+    unsigned int block = packetId / layout.blockPackets;
+    BlockState &state = blocks[block];
+    state.acked++;
+    if (state.acked != state.numPackets)
+        return;
+
+    // The check goes out once every block in it is complete.
+    BlockState &first = blocks[state.check];
+    for (unsigned int b = state.check; b < state.check + first.span; b++)
+    {
+        if (blocks[b].acked != blocks[b].numPackets)
+            return;
+    }
+    sendCheck(state.check);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     checkBlock
+//
+//    compares the server's digest of a check to ours. If they differ,
+//    a check of several blocks is split into one check per block.
+//    Packets the server says are missing get resent, and blocks that
+//    aren't missing any are checked again on their own. If a single
+//    block check fails with nothing missing, something got past the
+//    packet checksums, and a Merkle search over the block finds which
+//    packets to resend.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::checkBlock(EndToEndResponsePacket &response)
+{
+    if (response.packetId % layout.blockPackets != 0 || response.packetId >= ttlPackets)
+        return;
+
+    unsigned int block = response.packetId / layout.blockPackets;
+    BlockState &state = blocks[block];
+
+    // Late duplicate of a response we already acted on, or for a check since split up.
+    if (state.check != block || !state.checkSent || state.verified || response.count != checkPackets(block))
+        return;
+
+    unsigned int span = state.span;
+    unsigned char obuf[20];
+    checkHash(block, obuf);
+
+    bool passed = memcmp(obuf, response.obuf, 20) == 0;
+    sizer->result(span, passed);
+    if (passed)
+    {
+        for (unsigned int b = block; b < block + span; b++)
+        {
+            blocks[b].verified = true;
+            blocks[b].data = nullptr;
+            blocks[b].packedData = nullptr;
+        }
+        while (baseBlock < blocks.size() && blocks[baseBlock].verified)
+            baseBlock++;
+        return;
+    }
+
+    state.checkSent = false;
+
+    unsigned int lost = 0;
+    for (unsigned int b = block; b < block + span; b++)
+    {
+        BlockState &part = blocks[b];
+        part.check = b;
+        part.span = 1;
+
+        vector<unsigned int> missing;
+        for (unsigned int i = 0; i < part.numPackets; i++)
+        {
+            unsigned int bit = part.firstPacket - response.packetId + i;
+            if (response.missing[bit / 8] & (1 << (bit % 8)))
+                missing.push_back(i);
+        }
+
+        if (!missing.empty())
+        {
+            lost += missing.size();
+            resendPackets(b, missing);
+        }
+        else if (span > 1)
+            sendCheck(b);
+        else
+        {
+            size_t bytes = min(layout.blockBytes(), sourceSize - size_t(part.firstPacket) * layout.payload);
+            vector<unsigned int> leaves;
+            leafDigests(part.data, bytes, layout.payload, leaves);
+            part.search = new MerkleSearch(fileId, leaves, 0, b * MERKLE_BLOCK_SLOTS, MERKLE_BLOCK_LEVEL, b);
+        }
+    }
+
+    // Packets the server never got count as lost to congestion. Corrupt ones don't.
+    if (lost > 0)
+        congestion->lost(lost);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     finishSearch
+//
+//    resends the packets a block's Merkle search found. If it found
+//    none, the block changed under us somewhere, so all of it goes.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::finishSearch(unsigned int block)
+{
+    BlockState &state = blocks[block];
+    vector<unsigned int> bad = state.search->mismatched();
+    delete state.search;
+    state.search = nullptr;
+
+    if (bad.empty())
+    {
+        for (unsigned int i = 0; i < state.numPackets; i++)
+            bad.push_back(i);
+    }
+    resendPackets(block, bad);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     resendPackets
+//
+//    queues the given packets of a block (by index in the block) to
+//    be sent again after a failed check.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void FileSender::resendPackets(unsigned int block, const vector<unsigned int> &which)
+{
+    BlockState &state = blocks[block];
+
+    *GRADING << "File: " << fname << " packets number: " << state.firstPacket
+             << " through: " << state.firstPacket + state.numPackets - 1 << " transmission failed on attempt "
+             << state.attempts << ", " << which.size() << " packets to resend.  Retrying transmission." << endl;
+    state.attempts++;
+
+    for (unsigned int i = 0; i < which.size(); i++)
+    {
+        unsigned int packetId = state.firstPacket + which[i];
+        if (which[i] < state.numPackets && packets[slot(packetId)] == ACKED)
+        {
+            packets[slot(packetId)] = QUEUED;
+            resend.push_back(packetId);
+            state.acked--;
+        }
+    }
+
+    // nothing could be queued, so check again rather than wait forever
+    if (state.acked == state.numPackets)
+        sendCheck(block);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     CheckSizer
+//
+//    blocks for the next check, at most most. The failure rate per
+//    block is failed checks over blocks checked, which is close
+//    enough while failures are rare, and they're all that matter.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int CheckSizer::blocks(unsigned int most)
+{
+    double k = most;
+    if (checkedBlocks == 0)
+        k = INITIAL_CHECK_BLOCKS;
+    else if (failedChecks > 0)
+        k = 1 / sqrt(failedChecks / checkedBlocks);
+
+    lastSize = max(1u, min(most, (unsigned int)(k + 0.5)));
+    return lastSize;
+}
+
+void CheckSizer::result(unsigned int blocks, bool passed)
+{
+    checks++;
+    checkedBlocks += blocks;
+    if (!passed)
+    {
+        failures++;
+        failedChecks++;
+    }
+
+    if (checkedBlocks > CHECK_HISTORY)
+    {
+        checkedBlocks /= 2;
+        failedChecks /= 2;
+    }
+}
+
+unsigned long CheckSizer::checksDone()
+{
+    return checks;
+}
+
+unsigned long CheckSizer::checksFailed()
+{
+    return failures;
+}
+
+unsigned int CheckSizer::lastBlocks()
+{
+    return lastSize;
+}
@@ -0,0 +1,205 @@
+//
+//        filesender.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef FILESENDER_H
+#define FILESENDER_H
+
+#include "filehelper.h"
+#include "filereader.h"
+#include "merkle.h"
+#include "congestion.h"
+#include "delta.h"
+#include <deque>
+
+// Most data packets of one file we let be sent but not yet acknowledged by the
+// server. How many bytes all files have in flight is up to CongestionControl.
+const unsigned int WINDOW_SIZE = 64;
+
+// Most blocks that may have packets or an 'e' check outstanding at once.
+// This is also all of the file the sender keeps in memory.
+const unsigned int BLOCK_WINDOW = 32;
+
+// Blocks an 'e' check covers before any check has passed or failed, and how
+// many blocks' worth of checks the failure rate is measured over.
+const unsigned int INITIAL_CHECK_BLOCKS = 4;
+const unsigned int CHECK_HISTORY = 256;
+
+// Most blocks sent raw without trying to compress them, after blocks in a
+// row that didn't compress. Each one that doesn't doubles the run, up to this.
+const unsigned int PACKING_BACKOFF = 64;
+
+// Forward error correction: below FEC_MIN_LOSS of packets lost, no parity
+// is sent. Above it, each block's packets are split into groups of about
+// FEC_TARGET / loss rate, at most a block, each with one parity packet, so
+// a group loses about FEC_TARGET packets on average and rarely more than the
+// one its parity can rebuild.
+const double FEC_MIN_LOSS = 0.01;
+const double FEC_TARGET = 0.25;
+
+// State of a single data packet in the window.
+enum PacketState
+{
+    UNSENT,
+    IN_FLIGHT,
+    QUEUED, // waiting in the resend queue
+    ACKED
+};
+
+// A packet that went out at sentAt. Entries go stale when the packet is resent.
+struct SentPacket
+{
+    unsigned int packetId;
+    Clock::time_point sentAt;
+};
+
+// State of one block's run of packets, verified by an 'e' check. A check may
+// cover several blocks; its state is kept in the first of them.
+struct BlockState
+{
+    unsigned int firstPacket = 0;
+    unsigned int numPackets = 0;
+    unsigned int acked = 0;
+    unsigned int check = 0; // first block of the check this block is in
+    unsigned int span = 1;  // blocks in the check, if this block starts one
+    int attempts = 1;
+    const char *data = nullptr; // the block's bytes, while it is in the window
+    unsigned int packed = 0;          // bytes of the block compressed, 0 if it goes raw
+    unsigned int fecGroup = 0;        // packets per parity packet on its first send, 0 for none
+    const char *packedData = nullptr; // and those bytes, while it is in the window
+    bool checkSent = false;
+    bool verified = false;
+    Clock::time_point checkSentAt;
+    unsigned char obuf[20];
+    MerkleSearch *search = nullptr; // looking for the bad packets after a failed check
+};
+
+// Picks how many blocks each 'e' check covers, from how often checks fail,
+// and is shared by every file since that's down to the network and server.
+//
+// A check costs about a round trip whatever it covers, and a failed one of
+// several blocks is split up and each block checked again on its own. With a
+// failure rate of q per block, checks of k blocks cost about 1/k of a check
+// per block plus q * k rechecks, which is least at k = 1 / sqrt(q).
+class CheckSizer
+{
+private:
+    double checkedBlocks = 0; // both decay, so the rate follows the recent past
+    double failedChecks = 0;
+    unsigned long checks = 0;
+    unsigned long failures = 0;
+    unsigned int lastSize = INITIAL_CHECK_BLOCKS;
+
+public:
+    unsigned int blocks(unsigned int most);
+    void result(unsigned int blocks, bool passed);
+
+    // stats
+    unsigned long checksDone();
+    unsigned long checksFailed();
+    unsigned int lastBlocks();
+};
+
+// Sliding window sender for one file. Keeps up to WINDOW_SIZE packets and
+// BLOCK_WINDOW blocks in flight, and resends on timeouts and failed checks.
+// Blocks are read from the FileReader as they enter the window, and the
+// Merkle block roots are built up from them as they go by.
+//
+// After a failed file check, repairOnly limits the sender to the blocks a
+// MerkleSearch blamed. Those are 'e' checked without sending their data first.
+//
+// When the server has an old copy of the file, copyFrom says which packets
+// it can copy out of it. Those go as 'd' copies the first time around, and
+// as data if a check finds them wrong. Copies aren't on the wire for long,
+// so they count toward neither WINDOW_SIZE nor the congestion window.
+//
+// resumeFrom skips the blocks a server cut short already verified. Their
+// Merkle roots are never worked out, so if the file check fails, they're
+// among the blocks checked again.
+//
+// Blocks sent without copies get parity packets on their first send, as
+// many as the loss rate calls for. They're never acked or resent.
+//
+// With a codec agreed, each block is compressed as it's loaded, and if that
+// saves at least a packet, the compressed bytes go in its first packets and
+// the rest count as acked. The block's 'e' check is of its raw bytes as
+// usual. If it fails, the block goes raw from then on.
+class FileSender
+{
+private:
+    C150NastyDgmSocket *sock;
+    WriteHelper *helper;
+    CongestionControl *congestion;
+    CheckSizer *sizer;
+    unsigned int fileId;
+    unsigned char digest; // BlockDigest for 'e' checks
+    unsigned char codec;  // BlockCodec for the first send of each block
+    Layout layout;
+    FileReader *reader;
+    size_t sourceSize;
+    string fname;
+    vector<char> window; // BLOCK_WINDOW block sized slots
+    vector<char> packedWindow; // and as many slots for the blocks compressed
+    size_t packedSlot = 0;
+    unsigned int skipPacking = 0; // blocks still to send raw without trying
+    unsigned int packingBackoff = 0;
+    TransmissionPacket packet; // reused for every data packet
+    TransmissionPacket parity; // and every parity packet
+
+    unsigned int ttlPackets;
+    vector<PacketState> packets; // indexed by slot(packetId)
+    vector<Clock::time_point> lastSent;
+    vector<bool> resent; // sent more than once, so its ack is no RTT sample
+    vector<bool> copied; // last went out as a 'd' copy
+    vector<uint64_t> copies; // where each packet starts in the server's old copy, if anywhere
+    vector<BlockState> blocks;
+    vector<unsigned int> blockRoots; // Merkle digest of each block
+    bool repairing = false;
+    deque<SentPacket> inFlight;
+    deque<unsigned int> resend;
+
+    unsigned int nextPacket = 0;  // first packet never sent
+    unsigned int nextCheck = 0;   // first block not yet in any check
+    unsigned int baseBlock = 0;   // first block not yet verified
+    unsigned int outstanding = 0; // data packets currently IN_FLIGHT
+
+    unsigned int slot(unsigned int packetId);
+    void loadBlock(unsigned int block);
+    void packBlock(unsigned int block, size_t bytes);
+    bool hasCopies(unsigned int block);
+    unsigned int fecGroup();
+    void sendParity(unsigned int block, unsigned int first, unsigned int count);
+    unsigned int pieces(const BlockState &state);
+    size_t wireBytes(unsigned int packetId);
+    void sendPacket(unsigned int packetId);
+    unsigned int copyRun(unsigned int packetId);
+    void sendCopy(unsigned int packetId, unsigned int count);
+    void markSent(unsigned int packetId, bool copy);
+    void formCheck(unsigned int block);
+    unsigned int checkPackets(unsigned int block);
+    void checkHash(unsigned int block, unsigned char obuf[20]);
+    void sendCheck(unsigned int block);
+    void checkBlock(EndToEndResponsePacket &response);
+    void finishSearch(unsigned int block);
+    void resendPackets(unsigned int block, const vector<unsigned int> &which);
+
+public:
+    FileSender(C150NastyDgmSocket *sock, WriteHelper *helper, CongestionControl *congestion, CheckSizer *sizer, unsigned int fileId,
+               unsigned char digest, unsigned char codec, Layout layout, FileReader *reader, const char *fname);
+    ~FileSender();
+
+    void repairOnly(const vector<unsigned int> &repairBlocks);
+    void copyFrom(const vector<uint64_t> &copyFrom);
+    void resumeFrom(unsigned int block);
+    const vector<unsigned int> &roots();
+
+    bool done();
+    unsigned int inFlightCount();
+    void pump(unsigned int room);
+    void handle(const char *msg, ssize_t len);
+    void ackPacket(unsigned int packetId);
+};
+
+#endif
@@ -10,35 +10,161 @@
 #include <fstream>
 #include <cstdlib>
 #include "filehelper.h"
+#include "filewriter.h"
+#include "filereader.h"
+#include "merkle.h"
+#include "delta.h"
+#include "manifest.h"
+#include "journal.h"
+#include <sys/stat.h>
 #include <dirent.h>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <cstddef>
+#include "spscqueue.h"
+#include <zlib.h>
 
 using namespace C150NETWORK; // for all the comp150 utilities
 
-unsigned char *checkHash(char *buffer, int startIndx, int numBytes, int nastiness);
+// Most blocks per file we keep in memory while they're being received and checked.
+// The client's window is BLOCK_WINDOW blocks, and this has to hold all of them.
+const unsigned int BLOCK_CACHE = 40;
 
 const int networkArg = 1; // server name is 1st arg
 const int fileArg = 2;    // nastiness name is 2nd arg
 const int targetArg = 3;  // src name is 3rd arg
 
-// Struct to store the current state of a file. Specifically, a buffer with it's currently copied-over
-// contents, the total size of the file, and if it's done.
+// The pieces of one compressed block that have come in so far.
+struct PackedBlock
+{
+    unsigned int size = 0; // compressed bytes in the whole block
+    vector<char> data;
+    vector<bool> got;
+    unsigned int count = 0;
+};
+
+// An 'x' parity packet, kept until its group is all here or it has rebuilt
+// the one packet missing from it.
+struct Parity
+{
+    unsigned int packed = 0; // as in the group's packets
+    unsigned int group = 0;
+    vector<char> bytes;
+};
+
+// Struct to store the current state of a file. Specifically, the .tmp file its packets are written to,
+// a cache of the blocks still being received, the total size of the file, and if it's done.
 struct State
 {
-    char *buffer;
-    unsigned int sz = 0;
+    FileWriter *file = nullptr;
+    Journal *journal = nullptr;            // which blocks of file have passed, in case we're cut short
+    unsigned int resumeBlock = 0;          // blocks the journal let us keep when the file started
+    FileReader *base = nullptr;            // the old copy of the file, if we had one, for 'g' and 'd'
+    vector<Signature> signatures;          // of each piece of base, once a 'g' has asked for it
+    vector<bool> signedPieces;
+    vector<bool> received;                 // which packets have arrived with a good checksum
+    map<unsigned int, vector<char>> cache; // recent blocks by block number, for 'e' checks
+    map<unsigned int, PackedBlock> packed; // compressed blocks still missing pieces
+    map<unsigned int, Parity> parity;      // by the first packet each covers
+    vector<Hash> blockHash;                // hash of each block as last verified on disk
+    vector<bool> blockOnDisk;
+    vector<unsigned int> blockRoot;        // Merkle root of each block as it is on disk, for 'm' queries above a block
+    vector<bool> rootKnown;
+    unsigned char fileHash[20];
+    TreeHash fileCtx;              // running hash of every block before hashedBlocks
+    unsigned int hashedBlocks = 0; // verified blocks already in fileCtx, in order
+    size_t sz = 0;
+    unsigned char digest = DIGEST_SHA1; // BlockDigest for this file's 'e' checks
+    unsigned char codec = CODEC_NONE;   // BlockCodec the client may compress blocks with
+    Layout layout;                      // packet and block sizes for this file
     bool done = false;
     bool copied = false;
+    bool writeFailed = false; // the last write to file failed, and was logged
     string fname;
 };
 
-// Global data structures to hold data. a vector states, and a map to map a filename to it's corresponding vector index.
-vector<State *> inProg;
-unordered_map<std::string, int> fileNameToFileID;
+// Number of worker threads. Each file belongs to worker fileId % SERVER_WORKERS.
+const unsigned int SERVER_WORKERS = 4;
+
+// Most datagrams the receive thread reads before it flushes replies.
+const unsigned int RECV_BATCH = 32;
+
+// Datagrams a worker can have waiting in each direction. Anything past this is dropped,
+// and the client resends it like any other lost packet.
+const size_t WORKER_QUEUE = 128;
+
+// Longest a data ack waits for others to share its datagram while the worker is busy.
+const chrono::microseconds ACK_DELAY(500);
+
+// How long after a parity packet a worker keeps sending every ack datagram twice.
+const chrono::milliseconds PARITY_ACKS(500);
+
+// Largest reply a worker sends.
+const size_t MAX_REPLY = 512;
+
+// One datagram on its way to or from a worker, with the fileId it was routed by.
+template <size_t N>
+struct Datagram
+{
+    ssize_t len;
+    unsigned int fileId;
+    char msg[N];
+};
+
+// A worker thread and the files it owns. Only the receive thread pushes incoming
+// and pops replies, and only the worker does the opposite, so neither queue needs a lock.
+struct Worker
+{
+    SpscQueue<Datagram<MAX_DATAGRAM>, WORKER_QUEUE> incoming;
+    SpscQueue<Datagram<MAX_REPLY>, WORKER_QUEUE> replies;
+    unordered_map<unsigned int, State *> files;
+    AckPacket acks;                          // data acks not sent yet
+    chrono::steady_clock::time_point oldestAck;
+    chrono::steady_clock::time_point lastParity; // when a client last sent one of its files parity
+};
+
+vector<char> &cachedBlock(State *state, unsigned int block);
+void storePacket(State *state, unsigned int packetId, const char *bytes, bool repair);
+bool storePiece(State *state, unsigned int packetId, unsigned int packed, const char *bytes, size_t len);
+void useParity(Worker *worker, State *state, unsigned int fileId, unsigned int packetId);
+void rebuildGroup(Worker *worker, State *state, unsigned int fileId, unsigned int groupStart);
+bool verifyBlock(State *state, unsigned int block);
+void hashTmpFile(State *state);
+void readBlock(State *state, unsigned int block, vector<char> &data);
+void resumeFile(State *state);
+void advanceFileHash(State *state);
+unsigned int merkleDigest(State *state, unsigned int level, unsigned int index);
+void resetFileHash(State *state);
+bool route(Worker *workers, char *msg, ssize_t len);
+void runWorker(Worker *worker);
+void handleMessage(Worker *worker, Datagram<MAX_DATAGRAM> &incoming);
+void reply(Worker *worker, const void *msg, size_t len);
+void queueAck(Worker *worker, unsigned int fileId, unsigned int packetId, bool lost = false);
+bool hasPacket(State *state, unsigned int packetId, unsigned int packed);
+void flushAcks(Worker *worker);
+
+// Set once from the command line before any worker starts.
+string targetDir;
+int fileNastiness;
+Manifest *manifest;
+
+// The receive thread hands out fileIds, so only it touches this map.
+unordered_map<std::string, unsigned int> fileNameToFileID;
+
+// Workers share cout and the grading log.
+mutex logLock;
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
 //                           main program
 //
+//      main is the receive thread. It owns the socket, reads datagrams
+//      a batch at a time and passes each to the worker for its file,
+//      then sends whatever replies the workers have ready.
+//
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 int main(int argc, char *argv[])
@@ -48,7 +174,7 @@ int main(int argc, char *argv[])
     // Variable declarations
     //
     ssize_t readlen;           // amount of data read from socket
-    char incomingMessage[512]; // received message data
+    char incomingMessage[MAX_DATAGRAM]; // received message data
     int nastiness;             // how aggressively do we drop packets, etc?
 
     //
@@ -69,6 +195,9 @@ int main(int argc, char *argv[])
         exit(4);
     }
     nastiness = atoi(argv[1]); // convert command line string to integer
+    fileNastiness = atoi(argv[fileArg]);
+    targetDir = argv[targetArg];
+    manifest = new Manifest(targetDir);
 
     //
     // Create socket, loop receiving and responding
@@ -80,267 +209,1198 @@ int main(int argc, char *argv[])
         //
         C150DgmSocket *sock = new C150NastyDgmSocket(nastiness);
 
-        string outputName = "";
+        // Short timeouts, so replies never wait long behind a quiet socket.
+        sock->turnOnTimeouts(1);
+
+        Worker *workers = new Worker[SERVER_WORKERS];
+        for (unsigned int i = 0; i < SERVER_WORKERS; i++)
+            thread(runWorker, &workers[i]).detach();
+
         //
         // infinite loop processing messages
         //
         while (1)
         {
-            readlen = sock->read(incomingMessage, 512);
-            if (readlen == 0)
+            for (unsigned int i = 0; i < RECV_BATCH; i++)
             {
-                continue;
+                readlen = sock->read(incomingMessage, sizeof(incomingMessage));
+                if (sock->timedout())
+                    break;
+                if (readlen > 0)
+                    route(workers, incomingMessage, readlen);
             }
 
-            char w[512];
-
-            // Every message's first character tells us what type of packet it is, so we switch on that.
-            switch (incomingMessage[0])
-            {
-
-                /*
-                 *  S : Refers to the start of transmissions of files.
-                 *  this tells us we need to create new fileName : ID mapping and element in array
-                 */
-
-            case 's':
+            // All writes happen here, since the socket isn't safe to share between threads.
+            for (unsigned int i = 0; i < SERVER_WORKERS; i++)
             {
-                StartPacket response = *(reinterpret_cast<StartPacket *>(incomingMessage));
-                // If we haven't seen this fileID, we add this filename and it's new ID to our data structures.
-                if (fileNameToFileID.find(response.name) == fileNameToFileID.end())
+                Datagram<MAX_REPLY> *out;
+                while ((out = workers[i].replies.front()) != nullptr)
                 {
-                    cout << "File: " << response.name << " starting to receive file" << endl;
-                    *GRADING << "File: " << response.name << " starting to receive file" << endl;
-                    int newIndex = inProg.size();
-                    fileNameToFileID[response.name] = newIndex;
-                    inProg.push_back(new State);
-                    inProg[newIndex]->buffer = nullptr;
-                    inProg[newIndex]->fname = response.name;
+                    sock->write(out->msg, out->len);
+                    workers[i].replies.pop();
                 }
-                State *newState = inProg[fileNameToFileID[response.name]];
+            }
+        }
+    }
 
-                if (newState->done)
-                    continue;
+    catch (C150NetworkException &e)
+    {
+        // Write to debug log
+        c150debug->printf(C150ALWAYSLOG, "Caught C150NetworkException: %s\n",
+                          e.formattedExplanation().c_str());
+        // In case we're logging to a file, write to the console too
+        cerr << argv[0] << ": caught C150NetworkException: " << e.formattedExplanation() << endl;
+    }
 
-                // checks to see if we need to update state size/buffer.
-                if (newState->buffer != nullptr && newState->sz != response.fileSz)
-                {
-                    cout << response.fileSz << endl;
-                    free(newState->buffer);
-                }
-                if (newState->buffer == nullptr)
-                {
-                    newState->sz = response.fileSz;
-                    newState->buffer = (char *)malloc(newState->sz);
-                }
+    // This only executes if there was an error caught above
+    return 4;
+}
 
-                // Making and sending a response packet.
-                StartResponsePacket pckt;
-                pckt.cmd = 's';
-                memcpy(pckt.name, response.name, (sizeof(response.name)));
-                pckt.fileId = fileNameToFileID[response.name];
-                pckt.fileSz = response.fileSz;
-                memcpy(incomingMessage, &pckt, sizeof(pckt));
-                sock->write(incomingMessage, sizeof(incomingMessage));
-                break;
-            }
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           route
+//      works out which file a datagram is for and queues it on that
+//      file's worker. 's' hands out the fileId for a new name, and 'c'
+//      is looked up by name. Returns false if the datagram was dropped.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-                /*
-                 *  I: In-transmission packets, which hold data from the file specified by via packetID.
-                 */
+bool route(Worker *workers, char *msg, ssize_t len)
+{
+    unsigned int fileId;
 
-            case 'i':
-            {
-                TransmissionPacket response = *(reinterpret_cast<TransmissionPacket *>(incomingMessage));
-                // Copying first 12 bytes of response to the sendPacket, which is what we will send
-                char sendPacket[sizeof(TransmissionResponsePacket)];
-                memcpy(sendPacket, &response, sizeof(sendPacket));
+    switch (msg[0])
+    {
+    case 's':
+    {
+        if (len < (ssize_t)sizeof(StartPacket))
+            return false;
+        StartPacket *pckt = reinterpret_cast<StartPacket *>(msg);
+        pckt->name[sizeof(pckt->name) - 1] = '\0';
+        // If we haven't seen this file, it gets the next ID.
+        if (fileNameToFileID.find(pckt->name) == fileNameToFileID.end())
+        {
+            unsigned int newId = fileNameToFileID.size();
+            fileNameToFileID[pckt->name] = newId;
+        }
+        fileId = fileNameToFileID[pckt->name];
+        break;
+    }
+    case 'c':
+    {
+        if (len < (ssize_t)sizeof(ConfirmPacket))
+            return false;
+        ConfirmPacket *pckt = reinterpret_cast<ConfirmPacket *>(msg);
+        pckt->name[sizeof(pckt->name) - 1] = '\0';
+        if (fileNameToFileID.find(pckt->name) == fileNameToFileID.end())
+            return false;
+        fileId = fileNameToFileID[pckt->name];
+        break;
+    }
+    case 'i':
+    case 'e':
+    case 'f':
+    case 'm':
+    case 'g':
+    case 'd':
+    case 'x':
+    {
+        // the fileId sits in the same place in all of these
+        if (len < (ssize_t)(offsetof(EndToEndPacket, fileId) + sizeof(unsigned int)))
+            return false;
+        fileId = reinterpret_cast<EndToEndPacket *>(msg)->fileId;
+        // ignore packets for files we don't know about (e.g. a mangled fileId)
+        if (fileId >= fileNameToFileID.size())
+            return false;
+        break;
+    }
+    default:
+        return false;
+    }
 
-                // getting the current file's state.
-                State *currFile = inProg[response.fileId];
+    Worker *worker = &workers[fileId % SERVER_WORKERS];
+    Datagram<MAX_DATAGRAM> *d = worker->incoming.back();
+    if (d == nullptr)
+        return false;
 
-                // duplicate message handling
-                if (currFile->done)
-                    continue;
+    d->len = len;
+    d->fileId = fileId;
+    memcpy(d->msg, msg, len);
+    worker->incoming.push();
+    return true;
+}
 
-                // writing to current file's buffer
-                unsigned int bytes = min(unsigned(SEND_SIZE), currFile->sz - (response.packetId * SEND_SIZE));
-                for (unsigned int i = 0; i < bytes; i++)
-                {
-                    currFile->buffer[i + (response.packetId * SEND_SIZE)] = response.bytes[i];
-                }
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           runWorker
+//      handles a worker's datagrams as they come in, backing off to
+//      short sleeps when there's nothing to do. Data acks are held back
+//      until ACK_BATCH are waiting, the queue runs dry, or ACK_DELAY passes.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-                break;
-            }
-                /*
-                 *  E: end-to-end packets, which tell the server an end-to-end check on a series of packets has started.
-                 *  contains the filename, the sequence of packets and the hash of that sequence.
-                 */
+void runWorker(Worker *worker)
+{
+    int idle = 0;
+    while (1)
+    {
+        Datagram<MAX_DATAGRAM> *d = worker->incoming.front();
+        if (d == nullptr)
+        {
+            if (++idle < 64)
+                this_thread::yield();
+            else
+                this_thread::sleep_for(chrono::microseconds(100));
+            continue;
+        }
 
-            case 'e':
-            {
+        idle = 0;
+        handleMessage(worker, *d);
+        worker->incoming.pop();
 
-                EndToEndPacket incoming = *(reinterpret_cast<EndToEndPacket *>(incomingMessage));
-                // Getting corresponding state and how many bytes we're doing end-to-end check on.
-                State *state = inProg[incoming.fileId];
+        if (worker->acks.count > 0 &&
+            (worker->incoming.front() == nullptr || chrono::steady_clock::now() - worker->oldestAck >= ACK_DELAY))
+            flushAcks(worker);
+    }
+}
 
-                if (state->done)
-                    continue;
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           reply
+//      queues a response for the receive thread to send.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-                unsigned int bytes = min(unsigned(CHECK_SIZE * SEND_SIZE), state->sz - incoming.packetId * SEND_SIZE);
+void reply(Worker *worker, const void *msg, size_t len)
+{
+    Datagram<MAX_REPLY> *d;
+    while ((d = worker->replies.back()) == nullptr)
+        this_thread::yield();
 
-                // Building send packet
-                EndToEndResponsePacket pckt;
-                pckt.cmd = 'e';
-                pckt.fileId = incoming.fileId;
-                pckt.packetId = incoming.packetId;
+    d->len = len;
+    memcpy(d->msg, msg, len);
+    worker->replies.push();
+}
 
-                // Comparing hash values of the given bytes and the corresponding buffer's bytes.
-                unsigned char *hash = checkHash(state->buffer, incoming.packetId, bytes, stoi(argv[fileArg]));
-                memcpy(pckt.obuf, hash, sizeof(pckt.obuf));
-                memcpy(w, &pckt, sizeof(pckt));
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           queueAck / flushAcks
+//      add a data ack to the worker's next 'a' datagram, and send it.
+//      lost says the packet's first send never got here. While a
+//      client is sending parity, each 'a' goes twice.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-                sock->write(w, sizeof(EndToEndResponsePacket));
-                break;
-            }
-                /*
-                 *  F: end-to-end packets, which tell the server an end-to-end check on an entire file has started.
-                 *  contains the file ID.
-                 */
+void queueAck(Worker *worker, unsigned int fileId, unsigned int packetId, bool lost)
+{
+    if (worker->acks.count == 0)
+        worker->oldestAck = chrono::steady_clock::now();
+
+    if (lost)
+        worker->acks.lost++;
+    worker->acks.acks[worker->acks.count].fileId = fileId;
+    worker->acks.acks[worker->acks.count].packetId = packetId;
+    if (++worker->acks.count == ACK_BATCH)
+        flushAcks(worker);
+}
+
+void flushAcks(Worker *worker)
+{
+    size_t len = offsetof(AckPacket, acks) + worker->acks.count * sizeof(AckRecord);
+    reply(worker, &worker->acks, len);
+
+    // Parity means the client is seeing losses, and a lost ack costs a resend as
+    // surely as lost data, so acks go twice. Their losses only count once.
+    if (chrono::steady_clock::now() - worker->lastParity < PARITY_ACKS)
+    {
+        worker->acks.lost = 0;
+        reply(worker, &worker->acks, len);
+    }
+    worker->acks.count = 0;
+    worker->acks.lost = 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           handleMessage
+//      processes one datagram for a file this worker owns.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void handleMessage(Worker *worker, Datagram<MAX_DATAGRAM> &incoming)
+{
+    char *incomingMessage = incoming.msg;
+    char w[MAX_REPLY];
+
+    // Every file but the one 's' is starting must already be here.
+    unordered_map<unsigned int, State *>::iterator it = worker->files.find(incoming.fileId);
+    if (it == worker->files.end() && incomingMessage[0] != 's')
+        return;
+
+    // Every message's first character tells us what type of packet it is, so we switch on that.
+    switch (incomingMessage[0])
+    {
+
+        /*
+         *  S : Refers to the start of transmissions of files.
+         *  the receive thread has already given the name its ID, so this creates its state.
+         */
+
+    case 's':
+    {
+        StartPacket response = *(reinterpret_cast<StartPacket *>(incomingMessage));
+
+        // Names can have directories in them, but none may lead out of the target
+        // directory, and each of those has to be a directory we can put the file in.
+        bool refused = !safeName(response.name) || !makeDirectories(targetDir, response.name);
+        if (refused)
+        {
+            lock_guard<mutex> lock(logLock);
+            cerr << "File: " << response.name << " can't be received into " << targetDir << ", refusing it" << endl;
+        }
+
+        // A file we received before and still have as it was needs nothing more,
+        // and one we can't take gets nothing more.
+        if (refused || manifest->identical(response.name, response.fileSz, response.hash))
+        {
+            StartResponsePacket pckt;
+            memset(&pckt, 0, sizeof(pckt));
+            pckt.cmd = 's';
+            memcpy(pckt.name, response.name, sizeof(response.name));
+            pckt.fileId = incoming.fileId;
+            pckt.fileSz = response.fileSz;
+            pckt.identical = !refused;
+            pckt.refused = refused;
+            reply(worker, &pckt, sizeof(pckt));
+            return;
+        }
 
-            case 'f':
+        // If we haven't seen this fileID, we add a state for it.
+        if (it == worker->files.end())
+        {
             {
-                EndToEndPacket incoming = *(reinterpret_cast<EndToEndPacket *>(incomingMessage));
+                lock_guard<mutex> lock(logLock);
+                cout << "File: " << response.name << " starting to receive file" << endl;
+                *GRADING << "File: " << response.name << " starting to receive file" << endl;
+            }
+            it = worker->files.insert(make_pair(incoming.fileId, new State)).first;
+            it->second->fname = response.name;
+        }
+        State *newState = it->second;
 
-                // Getting corresponding state
-                State *state = inProg[incoming.fileId];
-                string finishName = state->fname;
+        if (newState->done)
+            return;
 
-                // Creating temporary file to write buffer holding file data.
-                finishName += ".tmp";
-                string finishDir = makeFileName(argv[targetArg], finishName);
-                unsigned char obuf[20];
+        // checks to see if we need to update state size/file.
+        if (newState->file != nullptr && newState->sz != response.fileSz)
+        {
+            delete newState->file;
+            newState->file = nullptr;
+        }
+        if (newState->file == nullptr)
+        {
+            string tmpName = makeFileName(targetDir, newState->fname + ".tmp");
+            // We take the client's payload, up to what we can read in one datagram.
+            newState->layout = makeLayout(response.payload);
+            size_t blockBytes = newState->layout.blockBytes();
+            unsigned int ttlBlocks = (response.fileSz + blockBytes - 1) / blockBytes;
 
-                cout << "PERFORMING FINAL END TO END CHECK ON " << finishName << endl;
-                *GRADING << "File: " << state->fname << " received, beginning end-to-end check" << endl;
+            newState->sz = response.fileSz;
+            newState->digest = knownDigest(response.digest) ? response.digest : DIGEST_SHA1;
+            newState->codec = knownCodec(response.codec) ? response.codec : CODEC_NONE;
 
-                if (state->done)
-                    continue;
+            // A journal for this very transfer means a .tmp file we can keep, if it's still there.
+            delete newState->journal;
+            newState->journal = new Journal(makeFileName(targetDir, newState->fname + JOURNAL_SUFFIX), newState->sz,
+                                            newState->layout.payload, newState->digest, response.hash, ttlBlocks);
+            struct stat tmpStat;
+            bool keep = newState->journal->resumed() && lstat(tmpName.c_str(), &tmpStat) == 0 &&
+                        S_ISREG(tmpStat.st_mode) && size_t(tmpStat.st_size) == newState->sz;
+            if (!keep)
+                newState->journal->clear();
+            newState->file = new FileWriter(tmpName, newState->sz, fileNastiness, keep);
 
-                // While loop, writing to tmp file until the write is correct
-                while (!state->copied)
-                {
-                    // Writing buffer to file
-                    NASTYFILE outputFile(atoi(argv[fileArg]));
-                    outputFile.fopen(finishDir.c_str(), "wb");
+            // An old copy of the file means the client can send just what changed.
+            struct stat statbuf;
+            if (newState->base == nullptr && lstat(makeFileName(targetDir, newState->fname).c_str(), &statbuf) == 0 &&
+                S_ISREG(statbuf.st_mode) && statbuf.st_size > 0)
+                newState->base = new FileReader(targetDir, newState->fname.c_str(), fileNastiness);
+            newState->received.assign((newState->sz + newState->layout.payload - 1) / newState->layout.payload, false);
+            newState->cache.clear();
+            newState->packed.clear();
+            newState->parity.clear();
+            newState->blockHash.resize(ttlBlocks);
+            newState->blockOnDisk.assign(ttlBlocks, false);
+            newState->blockRoot.resize(ttlBlocks);
+            newState->rootKnown.assign(ttlBlocks, false);
+            newState->copied = false;
+            resetFileHash(newState);
+            newState->resumeBlock = 0;
+            if (keep)
+                resumeFile(newState);
+        }
 
-                    outputFile.fwrite(state->buffer, 1, state->sz);
+        // Making and sending a response packet.
+        StartResponsePacket pckt;
+        pckt.cmd = 's';
+        memcpy(pckt.name, response.name, (sizeof(response.name)));
+        pckt.fileId = incoming.fileId;
+        pckt.fileSz = response.fileSz;
+        pckt.digest = newState->digest;
+        pckt.payload = newState->layout.payload;
+        pckt.codec = newState->codec;
+        pckt.resumeBlock = newState->resumeBlock;
+        pckt.baseSize = newState->base != nullptr ? newState->base->size() : 0;
+        pckt.identical = false;
+        pckt.refused = false;
+        reply(worker, &pckt, sizeof(pckt));
+        break;
+    }
 
-                    if (outputFile.fclose() != 0)
-                    {
-                        break;
-                        cerr << "Error closing output file " << finishName << " errno=" << strerror(errno) << endl;
-                    }
+        /*
+         *  I: In-transmission packets, which hold data from the file specified by via packetID.
+         */
 
-                    // Getting hash of file.
-                    string hash = hashFile(argv[targetArg], finishName, nastiness);
-                    // unsigned char obuf[20];
-                    SHA1((const unsigned char *)state->buffer,
-                         state->sz, obuf);
+    case 'i':
+    {
+        // Only the header and the data went over the wire, so this is read in place.
+        TransmissionPacket &response = *(reinterpret_cast<TransmissionPacket *>(incomingMessage));
+        if (incoming.len < (ssize_t)PACKET_HEADER)
+            return;
+        size_t bytes = incoming.len - PACKET_HEADER;
 
-                    // Comparing file hash and buffer hash.
-                    if (hash == getHexRepresentation(obuf, 20))
-                    {
-                        // *GRADING << "File: " << response.name << " end-to-end check succeeded." << endl;
-                        state->copied = true;
-                    }
-                }
+        // drop packets the network mangled; the client resends anything we don't ack
+        if (packetChecksum(response, bytes) != response.checksum)
+            return;
 
-                // Send response
-                EndToEndResponsePacket pckt;
-                pckt.cmd = 'f';
-                pckt.fileId = incoming.fileId;
-                pckt.packetId = 0;
+        // getting the current file's state.
+        State *currFile = it->second;
+        Layout &layout = currFile->layout;
 
-                memcpy(pckt.obuf, obuf, sizeof(pckt.obuf));
-                memcpy(w, &pckt, sizeof(pckt));
+        // duplicate message handling, and data that doesn't line up with a whole packet
+        size_t offset = response.offset;
+        if (currFile->done || currFile->file == nullptr || offset >= currFile->sz || offset % layout.payload != 0)
+            return;
 
-                sock->write(w, sizeof(EndToEndResponsePacket));
-            }
+        // A piece of a compressed block is acked as it comes in, though nothing
+        // is stored until the whole block is here. A resend of something we
+        // didn't have means its first send was lost, which the client's
+        // forward error correction wants to know.
+        unsigned int packetId = offset / layout.payload;
+        bool lost = response.resent && !hasPacket(currFile, packetId, response.packed);
+        if (response.packed > 0)
+        {
+            if (!storePiece(currFile, packetId, response.packed, response.bytes, bytes))
+                return;
+        }
+        else
+        {
+            if (bytes != min(size_t(layout.payload), currFile->sz - offset))
+                return;
+            // the client only sends a block raw after its compressed pieces, if any, are no use
+            currFile->packed.erase(packetId / layout.blockPackets);
+            storePacket(currFile, packetId, response.bytes, response.repair);
+        }
+        useParity(worker, currFile, incoming.fileId, packetId);
 
-                /*
-                 *  C: confirm packets, which tell the server an end-to-end check has finished, and the result has
-                 *  been acknowledged.
-                 */
+        // acknowledge the packet so the client can slide its window forward.
+        queueAck(worker, response.fileId, packetId, lost);
+        break;
+    }
 
-            case 'c':
+        /*
+         *  X: parity packets, the XOR of a group of data packets of one block. Once all but one of the
+         *  group is here, the parity gives us that one too, and it is acked as if it had come.
+         */
+
+    case 'x':
+    {
+        TransmissionPacket &response = *(reinterpret_cast<TransmissionPacket *>(incomingMessage));
+        if (incoming.len < (ssize_t)PACKET_HEADER)
+            return;
+        size_t bytes = incoming.len - PACKET_HEADER;
+        if (packetChecksum(response, bytes) != response.checksum)
+            return;
+
+        State *state = it->second;
+        Layout &layout = state->layout;
+        size_t offset = response.offset;
+        if (state->done || state->file == nullptr || offset >= state->sz || offset % layout.payload != 0 || response.group == 0)
+            return;
+
+        // The group has to fit in the block's packets, or its pieces if it's compressed.
+        unsigned int packetId = offset / layout.payload;
+        unsigned int first = packetId / layout.blockPackets * layout.blockPackets;
+        unsigned int numPackets = min(size_t(layout.blockPackets), state->received.size() - first);
+        unsigned int members = numPackets;
+        size_t len = min(size_t(layout.payload), state->sz - offset);
+        if (response.packed > 0)
+        {
+            members = (response.packed + layout.payload - 1) / layout.payload;
+            len = min(size_t(layout.payload), response.packed - size_t(packetId - first) * layout.payload);
+            if (state->codec != CODEC_ZLIB || members >= numPackets || size_t(packetId - first) * layout.payload >= response.packed)
+                return;
+        }
+        if (packetId - first + response.group > members || bytes != len)
+            return;
+
+        worker->lastParity = chrono::steady_clock::now();
+        Parity &parity = state->parity[packetId];
+        parity.packed = response.packed;
+        parity.group = response.group;
+        parity.bytes.assign(response.bytes, response.bytes + bytes);
+        rebuildGroup(worker, state, incoming.fileId, packetId);
+        break;
+    }
+
+        /*
+         *  D: delta copies, which say a run of packets is the same as some bytes of our old copy of the
+         *  file. Those bytes are read from it and stored like data packets, and each one is acked.
+         */
+
+    case 'd':
+    {
+        if (incoming.len < (ssize_t)sizeof(CopyPacket))
+            return;
+        CopyPacket copy = *(reinterpret_cast<CopyPacket *>(incomingMessage));
+        State *state = it->second;
+        Layout &layout = state->layout;
+
+        if (state->done || state->file == nullptr || state->base == nullptr || copy.count == 0 ||
+            copy.count > layout.blockPackets || size_t(copy.packetId) + copy.count > state->received.size())
+            return;
+
+        size_t start = size_t(copy.packetId) * layout.payload;
+        size_t bytes = min(size_t(copy.count) * layout.payload, state->sz - start);
+        if (size_t(copy.base) + bytes > state->base->size())
+            return;
+
+        vector<char> buffer(bytes);
+        const char *data = state->base->read(copy.base, bytes, buffer.data());
+        for (unsigned int i = 0; i < copy.count; i++)
+        {
+            storePacket(state, copy.packetId + i, data + size_t(i) * layout.payload, false);
+            queueAck(worker, copy.fileId, copy.packetId + i);
+        }
+        break;
+    }
+        /*
+         *  E: end-to-end packets, which tell the server an end-to-end check on a series of packets has started.
+         *  contains the filename, the sequence of packets and the hash of that sequence.
+         */
+
+    case 'e':
+    {
+
+        if (incoming.len < (ssize_t)sizeof(EndToEndPacket))
+            return;
+        EndToEndPacket incomingCheck = *(reinterpret_cast<EndToEndPacket *>(incomingMessage));
+
+        // Getting corresponding state and the run of blocks the client wants checked.
+        State *state = it->second;
+        Layout &layout = state->layout;
+        size_t end = size_t(incomingCheck.packetId) + incomingCheck.count;
+
+        if (state->done || state->file == nullptr || incomingCheck.count == 0 || incomingCheck.count > (unsigned int)CHECK_SIZE ||
+            incomingCheck.packetId % layout.blockPackets != 0 || end > state->received.size() ||
+            (end % layout.blockPackets != 0 && end != state->received.size()))
+            return;
+
+        // Building send packet
+        EndToEndResponsePacket pckt;
+        pckt.cmd = 'e';
+        pckt.fileId = incomingCheck.fileId;
+        pckt.packetId = incomingCheck.packetId;
+        pckt.count = incomingCheck.count;
+        memset(pckt.missing, 0, sizeof(pckt.missing));
+
+        vector<Hash> digests;
+        for (unsigned int block = incomingCheck.packetId / layout.blockPackets; size_t(block) * layout.blockPackets < end; block++)
+        {
+            unsigned int first = block * layout.blockPackets;
+            size_t bytes = min(layout.blockBytes(), state->sz - size_t(first) * layout.payload);
+
+            // Marking every packet of the block we haven't got, so the client only resends those.
+            bool complete = true;
+            for (unsigned int i = first; i < first + layout.blockPackets && i < end; i++)
             {
-                // we just want to confirm we know the file did/didn't pass end-to-end check, so we
-                // can just send back this message
-                ConfirmPacket response = *(reinterpret_cast<ConfirmPacket *>(incomingMessage));
-                int id = fileNameToFileID[response.name];
-                string fname = makeFileName(argv[targetArg], response.name);
-                string oldName = fname;
-                oldName += ".tmp";
-                // if the end-to-end check succeeded, we rename the file by removing the 'tmp'. otherwise, we set
-                // the state of that file ID's copied to be false.
-                if (!inProg[id]->done)
+                if (!state->received[i])
                 {
+                    unsigned int bit = i - incomingCheck.packetId;
+                    pckt.missing[bit / 8] |= (1 << (bit % 8));
+                    complete = false;
+                }
+            }
 
-                    if (response.success == true)
-                    {
-                        *GRADING << "File: " << inProg[id]->fname << " end-to-end check succeeded" << endl;
-                        cout << "File: " << inProg[id]->fname << " transmission completed." << endl;
-                        rename(oldName.c_str(), fname.c_str());
-                        inProg[id]->done = true;
-                        free(inProg[id]->buffer);
-                    }
-                    else
+            // Hashing the cached block's bytes, for the client to compare with its own.
+            Hash hash;
+            vector<char> &data = cachedBlock(state, block);
+            blockDigest(state->digest, data.data(), bytes, hash.obuf);
+
+            // Once every packet is in, make sure the disk copy matches what we got
+            // before the block can fall out of the cache. A block that won't go to
+            // disk is missing all over again, and its digest can't match the client's.
+            if (complete && !state->blockOnDisk[block])
+            {
+                state->blockHash[block] = hash;
+                if (!verifyBlock(state, block))
+                {
+                    for (unsigned int i = first; i < first + layout.blockPackets && i < end; i++)
                     {
-                        *GRADING << "File: " << inProg[id]->fname << " end-to-end check failed" << endl;
-                        cout << "File: " << inProg[id]->fname << " end-to-end check failed, retrying." << endl;
-                        inProg[id]->copied = false;
+                        unsigned int bit = i - incomingCheck.packetId;
+                        pckt.missing[bit / 8] |= (1 << (bit % 8));
+                        state->received[i] = false;
                     }
-                    remove(oldName.c_str());
+                    memset(hash.obuf, 0, sizeof(hash.obuf));
                 }
+            }
+            digests.push_back(hash);
+        }
 
-                sock->write(incomingMessage, sizeof(ConfirmPacket));
+        // Add whatever is now verified to the file's hash, and answer for the whole run.
+        advanceFileHash(state);
+        checkDigest(state->digest, digests, pckt.obuf);
 
-                break;
+        // If the client's digest is ours, the check passed, so we can keep
+        // these blocks should we be cut short. Only blocks verified on disk count.
+        if (memcmp(pckt.obuf, incomingCheck.obuf, 20) == 0)
+        {
+            for (unsigned int block = incomingCheck.packetId / layout.blockPackets; size_t(block) * layout.blockPackets < end; block++)
+            {
+                if (state->blockOnDisk[block])
+                    state->journal->record(block, state->blockHash[block]);
             }
-            default:
+            state->journal->recordHash(state->hashedBlocks, state->fileCtx);
+        }
+        memcpy(w, &pckt, sizeof(pckt));
+        reply(worker, w, sizeof(EndToEndResponsePacket));
+        break;
+    }
+        /*
+         *  F: end-to-end packets, which tell the server an end-to-end check on an entire file has started.
+         *  contains the file ID. Hashing a big file here only holds up the files on this worker.
+         */
+
+    case 'f':
+    {
+        if (incoming.len < (ssize_t)sizeof(EndToEndPacket))
+            return;
+        EndToEndPacket incomingCheck = *(reinterpret_cast<EndToEndPacket *>(incomingMessage));
+
+        // Getting corresponding state
+        State *state = it->second;
+
+        {
+            lock_guard<mutex> lock(logLock);
+            cout << "PERFORMING FINAL END TO END CHECK ON " << state->fname << ".tmp" << endl;
+            *GRADING << "File: " << state->fname << " received, beginning end-to-end check" << endl;
+        }
+
+        if (state->done || state->file == nullptr)
+            return;
+
+        // The data is already in the .tmp file and most of it in the running hash,
+        // so all that's left is whatever the 'e' checks didn't cover.
+        // A repeated 'f' gets the same answer without reading the file again.
+        if (!state->copied)
+        {
+            hashTmpFile(state);
+            state->copied = true;
+        }
+
+        // Send response
+        EndToEndResponsePacket pckt;
+        pckt.cmd = 'f';
+        pckt.fileId = incomingCheck.fileId;
+        pckt.packetId = 0;
+        pckt.count = 0;
+
+        memcpy(pckt.obuf, state->fileHash, sizeof(pckt.obuf));
+        memcpy(w, &pckt, sizeof(pckt));
+
+        reply(worker, w, sizeof(EndToEndResponsePacket));
+        break;
+    }
+
+        /*
+         *  M: Merkle queries, which ask for the digests of some nodes of the file's Merkle tree, so the
+         *  client can narrow a failed check down to the packets that are actually wrong.
+         */
+
+    case 'm':
+    {
+        if (incoming.len < (ssize_t)sizeof(MerklePacket))
+            return;
+        MerklePacket query = *(reinterpret_cast<MerklePacket *>(incomingMessage));
+        State *state = it->second;
+
+        if (state->done || state->file == nullptr || query.level >= 32)
+            return;
+
+        // Zeroed, so digests past count and padding don't carry old stack bytes.
+        MerkleResponsePacket pckt;
+        memset(&pckt, 0, sizeof(pckt));
+        pckt.cmd = 'm';
+        pckt.fileId = query.fileId;
+        pckt.level = query.level;
+        pckt.first = query.first;
+        pckt.count = min(query.count, MERKLE_BATCH);
+        for (unsigned int k = 0; k < pckt.count; k++)
+            pckt.digests[k] = merkleDigest(state, query.level, query.first + k);
+
+        reply(worker, &pckt, sizeof(pckt));
+        break;
+    }
+
+        /*
+         *  G: signature queries, for the rsync signatures of some pieces of our old copy of the file.
+         */
+
+    case 'g':
+    {
+        if (incoming.len < (ssize_t)sizeof(SignaturePacket))
+            return;
+        SignaturePacket query = *(reinterpret_cast<SignaturePacket *>(incomingMessage));
+        State *state = it->second;
+
+        if (state->done || state->base == nullptr || query.count == 0 || query.count > SIGNATURE_BATCH)
+            return;
+
+        unsigned int payload = state->layout.payload;
+        size_t start = size_t(query.first) * payload;
+        size_t bytes = size_t(query.count) * payload;
+        if (start + bytes > state->base->size())
+            return;
+
+        // Signatures are kept once worked out, so a resent query costs no reading.
+        if (state->signatures.empty())
+        {
+            state->signatures.resize(state->base->size() / payload);
+            state->signedPieces.assign(state->signatures.size(), false);
+        }
+        bool missing = false;
+        for (unsigned int i = query.first; i < query.first + query.count; i++)
+            missing = missing || !state->signedPieces[i];
+        if (missing)
+        {
+            vector<char> buffer(bytes);
+            pieceSignatures(state->base->read(start, bytes, buffer.data()), bytes, payload, &state->signatures[query.first]);
+            for (unsigned int i = query.first; i < query.first + query.count; i++)
+                state->signedPieces[i] = true;
+        }
+
+        SignatureResponsePacket pckt;
+        pckt.cmd = 'g';
+        pckt.fileId = query.fileId;
+        pckt.first = query.first;
+        pckt.count = query.count;
+        memcpy(pckt.signatures, &state->signatures[query.first], query.count * sizeof(Signature));
+
+        reply(worker, &pckt, sizeof(pckt));
+        break;
+    }
+
+        /*
+         *  C: confirm packets, which tell the server an end-to-end check has finished, and the result has
+         *  been acknowledged.
+         */
+
+    case 'c':
+    {
+        // we just want to confirm we know the file did/didn't pass end-to-end check, so we
+        // can just send back this message
+        ConfirmPacket response = *(reinterpret_cast<ConfirmPacket *>(incomingMessage));
+        string fname = makeFileName(targetDir, response.name);
+        string oldName = fname;
+        oldName += ".tmp";
+        // if the end-to-end check succeeded, we rename the file by removing the 'tmp'. otherwise, we set
+        // the state of that file ID's copied to be false.
+        State *state = it->second;
+        if (!state->done)
+        {
+            lock_guard<mutex> lock(logLock);
+            if (response.success == true)
             {
-                break;
+                *GRADING << "File: " << state->fname << " end-to-end check succeeded" << endl;
+                cout << "File: " << state->fname << " transmission completed." << endl;
+                delete state->file;
+                state->file = nullptr;
+                state->journal->remove();
+                delete state->journal;
+                state->journal = nullptr;
+                delete state->base;
+                state->base = nullptr;
+                state->signatures.clear();
+                state->signedPieces.clear();
+                state->cache.clear();
+                state->packed.clear();
+                state->parity.clear();
+                rename(oldName.c_str(), fname.c_str());
+                manifest->record(state->fname, state->fileHash);
+                state->done = true;
             }
+            else
+            {
+                // The client finds the bad blocks with 'm' queries and repairs them in place,
+                // so we keep what we have. Blocks it checks again get read back off disk.
+                *GRADING << "File: " << state->fname << " end-to-end check failed" << endl;
+                cout << "File: " << state->fname << " end-to-end check failed, retrying." << endl;
+                state->cache.clear();
+                state->copied = false;
+                state->journal->clear();
+                resetFileHash(state);
             }
         }
+
+        reply(worker, incomingMessage, sizeof(ConfirmPacket));
+
+        break;
+    }
+    default:
+    {
+        break;
+    }
     }
+}
 
-    catch (C150NetworkException &e)
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           cachedBlock
+//      returns a block's cache entry, making room for it if it isn't
+//      there. A block that already has packets on disk is read back in.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+vector<char> &cachedBlock(State *state, unsigned int block)
+{
+    map<unsigned int, vector<char>>::iterator it = state->cache.find(block);
+    if (it != state->cache.end())
+        return it->second;
+
+    // The client only moves on to new blocks once old ones pass, so the lowest numbered one goes.
+    if (state->cache.size() >= BLOCK_CACHE)
+        state->cache.erase(state->cache.begin());
+
+    size_t start = size_t(block) * state->layout.blockBytes();
+    size_t bytes = min(state->layout.blockBytes(), state->sz - start);
+    vector<char> &data = state->cache[block];
+    data.resize(state->layout.blockBytes());
+
+    for (unsigned int i = block * state->layout.blockPackets; i < (block + 1) * state->layout.blockPackets && i < state->received.size(); i++)
     {
-        // Write to debug log
-        c150debug->printf(C150ALWAYSLOG, "Caught C150NetworkException: %s\n",
-                          e.formattedExplanation().c_str());
-        // In case we're logging to a file, write to the console too
-        cerr << argv[0] << ": caught C150NetworkException: " << e.formattedExplanation() << endl;
+        if (state->received[i])
+        {
+            state->file->readAt(start, data.data(), bytes);
+            break;
+        }
     }
+    return data;
+}
 
-    // This only executes if there was an error caught above
-    return 4;
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           storePacket
+//      puts one packet's bytes, from a data packet or a delta copy,
+//      into the .tmp file and its block's cache entry.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void storePacket(State *state, unsigned int packetId, const char *bytes, bool repair)
+{
+    Layout &layout = state->layout;
+    unsigned int block = packetId / layout.blockPackets;
+    size_t offset = size_t(packetId) * layout.payload;
+    size_t len = min(size_t(layout.payload), state->sz - offset);
+
+    // A repeat of a packet whose block has already left the cache was checked long ago,
+    // so we leave the disk alone, unless the client is repairing it. Anything else goes
+    // straight to the .tmp file, and into the block's cache for its 'e' check.
+    if (state->received[packetId] && !state->cache.count(block) && !repair)
+        return;
+
+    vector<char> &data = cachedBlock(state, block);
+    char *dest = data.data() + (offset - block * layout.blockBytes());
+
+    // A repeat of bytes we already have changes nothing, and writing them again could only
+    // let file nastiness spoil a block that may have passed its check already.
+    bool changed = !state->received[packetId] || memcmp(dest, bytes, len) != 0;
+    if (!changed && !repair)
+        return;
+
+    // New bytes in a block that's already in the running hash mean starting it over.
+    if (block < state->hashedBlocks && changed)
+        resetFileHash(state);
+    state->blockOnDisk[block] = false;
+    state->rootKnown[block] = false;
+
+    // Bytes that didn't make it to disk stay out of the cache too, so the
+    // block's 'e' check says the packet is missing and it's sent again.
+    if (!state->file->writeAt(offset, bytes, len))
+    {
+        if (!state->writeFailed)
+        {
+            lock_guard<mutex> lock(logLock);
+            cerr << "Error writing " << state->fname << ".tmp at " << offset << " errno=" << strerror(errno) << endl;
+        }
+        state->writeFailed = true;
+        state->received[packetId] = false;
+        return;
+    }
+    state->writeFailed = false;
+    memcpy(dest, bytes, len);
+    state->received[packetId] = true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           storePiece
+//      keeps one piece of a compressed block, and once all of them are
+//      here, inflates the block and stores each of its packets. A block
+//      that won't inflate is dropped, and its 'e' check says every packet
+//      is missing, so the client sends it again raw. Returns false if
+//      the piece can't belong to the block, so it isn't acked.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool storePiece(State *state, unsigned int packetId, unsigned int packed, const char *bytes, size_t len)
+{
+    Layout &layout = state->layout;
+    unsigned int block = packetId / layout.blockPackets;
+    unsigned int first = block * layout.blockPackets;
+    unsigned int numPackets = min(size_t(layout.blockPackets), state->received.size() - first);
+    size_t offset = size_t(packetId - first) * layout.payload;
+    unsigned int pieces = (packed + layout.payload - 1) / layout.payload;
+
+    if (state->codec != CODEC_ZLIB || pieces >= numPackets || offset >= packed ||
+        len != min(size_t(layout.payload), packed - offset))
+        return false;
+
+    // A late repeat of a piece of a block we already have.
+    bool complete = true;
+    for (unsigned int i = first; i < first + numPackets && complete; i++)
+        complete = state->received[i];
+    if (complete)
+        return true;
+
+    PackedBlock &staged = state->packed[block];
+    if (staged.size != packed)
+    {
+        staged.size = packed;
+        staged.data.resize(packed);
+        staged.got.assign(pieces, false);
+        staged.count = 0;
+    }
+    if (staged.got[packetId - first])
+        return true;
+    memcpy(staged.data.data() + offset, bytes, len);
+    staged.got[packetId - first] = true;
+    if (++staged.count < pieces)
+        return true;
+
+    size_t bytesInBlock = min(layout.blockBytes(), state->sz - size_t(first) * layout.payload);
+    vector<char> raw(bytesInBlock);
+    uLongf rawLen = bytesInBlock;
+    if (uncompress(reinterpret_cast<Bytef *>(raw.data()), &rawLen, reinterpret_cast<const Bytef *>(staged.data.data()), packed) == Z_OK &&
+        rawLen == bytesInBlock)
+    {
+        for (unsigned int i = 0; i < numPackets; i++)
+            storePacket(state, first + i, raw.data() + size_t(i) * layout.payload, false);
+    }
+    state->packed.erase(block);
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           useParity / rebuildGroup
+//      after a packet comes in, tries the parity of its group, if
+//      we have it. A group with one packet missing gets it back as the
+//      XOR of the parity and the rest, and one with none missing has
+//      no more use for its parity.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void useParity(Worker *worker, State *state, unsigned int fileId, unsigned int packetId)
+{
+    unsigned int first = packetId / state->layout.blockPackets * state->layout.blockPackets;
+    map<unsigned int, Parity>::iterator it = state->parity.lower_bound(first);
+    for (; it != state->parity.end() && it->first <= packetId; it++)
+    {
+        if (packetId < it->first + it->second.group)
+        {
+            rebuildGroup(worker, state, fileId, it->first);
+            return;
+        }
+    }
+}
+
+void rebuildGroup(Worker *worker, State *state, unsigned int fileId, unsigned int groupStart)
+{
+    Layout &layout = state->layout;
+    Parity &parity = state->parity[groupStart];
+    unsigned int block = groupStart / layout.blockPackets;
+    unsigned int first = block * layout.blockPackets;
+    unsigned int numPackets = min(size_t(layout.blockPackets), state->received.size() - first);
+
+    bool complete = true;
+    for (unsigned int i = first; i < first + numPackets && complete; i++)
+        complete = state->received[i];
+
+    unsigned int missing = 0;
+    unsigned int lost = 0;
+    for (unsigned int i = groupStart; i < groupStart + parity.group && !complete; i++)
+    {
+        if (!hasPacket(state, i, parity.packed))
+        {
+            missing++;
+            lost = i;
+        }
+    }
+    if (missing > 1)
+        return;
+    if (missing == 0)
+    {
+        state->parity.erase(groupStart);
+        return;
+    }
+
+    // The rest of the group is in the block's cache entry, or its staged pieces.
+    vector<char> *data = parity.packed == 0 ? &cachedBlock(state, block) : nullptr;
+    map<unsigned int, PackedBlock>::iterator staged = state->packed.find(block);
+    vector<char> bytes(parity.bytes);
+    for (unsigned int i = groupStart; i < groupStart + parity.group; i++)
+    {
+        if (i == lost)
+            continue;
+        size_t offset = size_t(i - first) * layout.payload;
+        if (parity.packed == 0)
+            xorBytes(bytes.data(), data->data() + offset, min(size_t(layout.payload), state->sz - size_t(i) * layout.payload));
+        else
+            xorBytes(bytes.data(), staged->second.data.data() + offset, min(size_t(layout.payload), parity.packed - offset));
+    }
+
+    unsigned int packed = parity.packed;
+    state->parity.erase(groupStart);
+    if (packed == 0)
+        storePacket(state, lost, bytes.data(), false);
+    else if (!storePiece(state, lost, packed, bytes.data(), min(size_t(layout.payload), packed - size_t(lost - first) * layout.payload)))
+        return;
+    queueAck(worker, fileId, lost, true);
+}
+
+// true if we have a packet, or if packed, that piece of its compressed block
+bool hasPacket(State *state, unsigned int packetId, unsigned int packed)
+{
+    if (state->received[packetId])
+        return true;
+    if (packed == 0)
+        return false;
+
+    unsigned int block = packetId / state->layout.blockPackets;
+    map<unsigned int, PackedBlock>::iterator staged = state->packed.find(block);
+    unsigned int k = packetId - block * state->layout.blockPackets;
+    return staged != state->packed.end() && staged->second.size == packed && k < staged->second.got.size() && staged->second.got[k];
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           verifyBlock
+//      makes sure a finished block on disk matches its cache entry,
+//      rewriting just the chunks that don't with file nastiness. The
+//      file's hash is built from cache entries that have passed this,
+//      so it covers what's on disk, not just what arrived. False if
+//      the disk copy can't be made right.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool verifyBlock(State *state, unsigned int block)
+{
+    size_t start = size_t(block) * state->layout.blockBytes();
+    size_t bytes = min(state->layout.blockBytes(), state->sz - start);
+    vector<char> &data = state->cache[block];
+    if (!state->file->verify(start, data.data(), bytes))
+    {
+        lock_guard<mutex> lock(logLock);
+        cerr << "Error verifying block " << block << " of " << state->fname << ".tmp on disk" << endl;
+        return false;
+    }
+    state->blockOnDisk[block] = true;
+
+    // The block's Merkle root is known now too, so 'm' queries above it needn't read it back.
+    vector<unsigned int> leaves;
+    leafDigests(data.data(), bytes, state->layout.payload, leaves);
+    state->blockRoot[block] = merkleNode(leaves.data(), leaves.size(), MERKLE_BLOCK_LEVEL, 0);
+    state->rootKnown[block] = true;
+    return true;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 //
-//                           checkHash
-//      this function computes the hash of a given buffer.
+//                           advanceFileHash / resetFileHash
+//      feed verified blocks into the file's running hash, in order,
+//      while they're still in the cache; or start it over.
 //
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-unsigned char *checkHash(char *buffer, int startIndx, int numBytes, int nastiness)
+void advanceFileHash(State *state)
 {
+    while (state->hashedBlocks < state->blockHash.size() && state->blockOnDisk[state->hashedBlocks])
+    {
+        map<unsigned int, vector<char>>::iterator it = state->cache.find(state->hashedBlocks);
+        if (it == state->cache.end())
+            return;
+
+        size_t start = size_t(state->hashedBlocks) * state->layout.blockBytes();
+        size_t bytes = min(state->layout.blockBytes(), state->sz - start);
+        state->fileCtx.update(it->second.data(), bytes);
+        state->hashedBlocks++;
+    }
+}
+
+void resetFileHash(State *state)
+{
+    state->fileCtx = TreeHash();
+    state->hashedBlocks = 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           merkleDigest
+//      our digest of one node of the file's Merkle tree. Nodes within
+//      a block come from its cache entry, like the block's 'e' check.
+//      Nodes above that cover many blocks, and are built from each
+//      block's root. A root is kept once worked out, until the block
+//      changes, so a block is only read from disk when it's neither
+//      verified nor cached. Empty nodes are 0.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int merkleDigest(State *state, unsigned int level, unsigned int index)
+{
+    vector<unsigned int> leaves;
+    size_t firstSlot = size_t(index) << level;
+    size_t firstBlock = firstSlot / MERKLE_BLOCK_SLOTS;
+    if (firstBlock >= state->blockHash.size() ||
+        firstSlot % MERKLE_BLOCK_SLOTS >= min(size_t(state->layout.blockPackets), state->received.size() - firstBlock * state->layout.blockPackets))
+        return 0;
+
+    if (level < MERKLE_BLOCK_LEVEL)
+    {
+        size_t start = firstBlock * state->layout.blockBytes();
+        size_t bytes = min(state->layout.blockBytes(), state->sz - start);
+        vector<char> &data = cachedBlock(state, firstBlock);
+        leafDigests(data.data(), bytes, state->layout.payload, leaves);
+        return merkleNode(leaves.data(), leaves.size(), level, index - (firstBlock << (MERKLE_BLOCK_LEVEL - level)));
+    }
+
+    size_t lastBlock = min(state->blockHash.size(), size_t(index + 1) << (level - MERKLE_BLOCK_LEVEL));
+    vector<unsigned int> roots;
+    vector<char> disk;
+    for (size_t block = firstBlock; block < lastBlock; block++)
+    {
+        if (state->rootKnown[block])
+        {
+            roots.push_back(state->blockRoot[block]);
+            continue;
+        }
+
+        size_t start = block * state->layout.blockBytes();
+        size_t bytes = min(state->layout.blockBytes(), state->sz - start);
+        const char *data;
+
+        map<unsigned int, vector<char>>::iterator it = state->cache.find(block);
+        if (it != state->cache.end())
+            data = it->second.data();
+        else
+        {
+            disk.resize(bytes);
+            state->file->readAt(start, disk.data(), bytes);
+            data = disk.data();
+        }
+
+        // A read from a nasty file might be wrong, so its root isn't kept.
+        leafDigests(data, bytes, state->layout.payload, leaves);
+        state->blockRoot[block] = merkleNode(leaves.data(), leaves.size(), MERKLE_BLOCK_LEVEL, 0);
+        state->rootKnown[block] = it != state->cache.end() || !state->file->nasty();
+        roots.push_back(state->blockRoot[block]);
+    }
+    return merkleNode(roots.data(), roots.size(), level - MERKLE_BLOCK_LEVEL, 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           hashTmpFile
+//      finishes state->fileHash from the running hash, reading back
+//      only the blocks it doesn't cover yet, one at a time. Blocks we
+//      verified on disk are re-read a few times if they don't match,
+//      since with file nastiness a bad read looks like a bad write.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void hashTmpFile(State *state)
+{
+    TreeHash ctx = state->fileCtx;
+    vector<char> data;
+
+    for (unsigned int block = state->hashedBlocks; block < state->blockHash.size(); block++)
+    {
+        readBlock(state, block, data);
+        ctx.update(data.data(), min(state->layout.blockBytes(), state->sz - size_t(block) * state->layout.blockBytes()));
+    }
+    ctx.final(state->fileHash);
+}
+
+// reads a block of the .tmp file into data, a few more times if it should match blockHash and doesn't
+void readBlock(State *state, unsigned int block, vector<char> &data)
+{
+    size_t start = size_t(block) * state->layout.blockBytes();
+    size_t bytes = min(state->layout.blockBytes(), state->sz - start);
+    unsigned char obuf[20];
+    data.resize(state->layout.blockBytes());
+
+    for (int attempts = 0; attempts < 5; attempts++)
+    {
+        state->file->readAt(start, data.data(), bytes);
+        blockDigest(state->digest, data.data(), bytes, obuf);
+        if (!state->blockOnDisk[block] || memcmp(obuf, state->blockHash[block].obuf, 20) == 0)
+            break;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                           resumeFile
+//      takes back every block the journal says passed its check, so
+//      the client can start after them, and picks the running hash up
+//      from where it was saved. Catching it up to the blocks the client
+//      will skip rereads at most JOURNAL_HASH_BLOCKS blocks.
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void resumeFile(State *state)
+{
+    Layout &layout = state->layout;
+    Journal *journal = state->journal;
+    for (unsigned int block = 0; block < state->blockHash.size(); block++)
+    {
+        if (!journal->isVerified(block))
+            continue;
+        for (unsigned int i = block * layout.blockPackets; i < (block + 1) * layout.blockPackets && i < state->received.size(); i++)
+            state->received[i] = true;
+        state->blockHash[block] = journal->blockHash(block);
+        state->blockOnDisk[block] = true;
+    }
+    state->resumeBlock = journal->verifiedPrefix();
+
+    state->hashedBlocks = journal->savedHash(state->fileCtx);
+    vector<char> data;
+    for (; state->hashedBlocks < state->resumeBlock; state->hashedBlocks++)
+    {
+        readBlock(state, state->hashedBlocks, data);
+        state->fileCtx.update(data.data(), min(layout.blockBytes(), state->sz - size_t(state->hashedBlocks) * layout.blockBytes()));
+    }
 
-    unsigned char *obuf = (unsigned char *)malloc(20);
-    SHA1((const unsigned char *)(buffer + (startIndx * SEND_SIZE)),
-         numBytes, obuf);
-    return obuf;
+    lock_guard<mutex> lock(logLock);
+    cout << "File: " << state->fname << " resuming after " << state->resumeBlock << " of " << state->blockHash.size() << " blocks." << endl;
+    *GRADING << "File: " << state->fname << " resuming from journal, " << state->resumeBlock << " blocks already verified" << endl;
 }
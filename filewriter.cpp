@@ -0,0 +1,186 @@
+//
+//        filewriter.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "filewriter.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <iostream>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     FileWriter
+//
+//      creates the file at its full size, so any packet can be
+//      written wherever it belongs as soon as it shows up. With keep,
+//      a file that's already there is opened as it is instead, so a
+//      transfer can carry on into it.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+FileWriter::FileWriter(string fileName, size_t fileSize, int nastiness, bool keep)
+    : fileName(fileName), fileSize(fileSize)
+{
+    if (nastiness == 0)
+    {
+        fd = open(fileName.c_str(), O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+        if (fd < 0)
+        {
+            cerr << "Error creating output file " << fileName << " errno=" << strerror(errno) << endl;
+            exit(16);
+        }
+
+        // reserve the space now, falling back to a sparse file if we can't
+        if (fileSize > 0 && posix_fallocate(fd, 0, fileSize) != 0 && ftruncate(fd, fileSize) != 0)
+            cerr << "Error sizing output file " << fileName << " errno=" << strerror(errno) << endl;
+        return;
+    }
+
+    outputFile = new NASTYFILE(nastiness);
+    if (outputFile->fopen(fileName.c_str(), keep ? "r+b" : "w+b") == NULL)
+    {
+        cerr << "Error creating output file " << fileName << " errno=" << strerror(errno) << endl;
+        exit(16);
+    }
+    if (truncate(fileName.c_str(), fileSize) != 0)
+        cerr << "Error sizing output file " << fileName << " errno=" << strerror(errno) << endl;
+}
+
+FileWriter::~FileWriter()
+{
+    if (fd >= 0)
+        close(fd);
+
+    if (outputFile != nullptr)
+    {
+        if (outputFile->fclose() != 0)
+            cerr << "Error closing output file " << fileName << " errno=" << strerror(errno) << endl;
+        delete outputFile;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     nasty
+//
+//      true if what we write might not be what lands on disk.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileWriter::nasty()
+{
+    return outputFile != nullptr;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     writeAt
+//
+//        writes len bytes at offset. false on a short write.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileWriter::writeAt(size_t offset, const char *data, size_t len)
+{
+    if (fd >= 0)
+        return pwrite(fd, data, len, offset) == (ssize_t)len;
+
+    outputFile->fseek(offset, SEEK_SET);
+    return outputFile->fwrite(data, 1, len) == len;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     readAt
+//
+//        reads len bytes at offset. false on a short read.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileWriter::readAt(size_t offset, char *dest, size_t len)
+{
+    if (fd >= 0)
+        return pread(fd, dest, len, offset) == (ssize_t)len;
+
+    outputFile->fseek(offset, SEEK_SET);
+    return outputFile->fread(dest, 1, len) == len;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     verify
+//
+//    reads back the len bytes at offset, which should be data, and
+//    rewrites each VERIFY_CHUNK that isn't until it reads back right.
+//    A bad read looks just like a bad write, and rewriting a chunk
+//    is no dearer than reading it again, so both get the same fix.
+//    False if the bytes can't be written at all, or without file
+//    nastiness, if they don't read back right the one time.
+//
+//    With nastiness everything is read back twice, whole and then in
+//    two halves. A bad write and a bad read can spoil the same byte
+//    the same way and cancel out, and the same mistake twice from
+//    different read sizes is too unlikely to matter.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileWriter::verify(size_t offset, const char *data, size_t len)
+{
+    if (disk.size() < len)
+    {
+        disk.resize(len);
+        halves.resize(len);
+    }
+    bool read = readAt(offset, disk.data(), len);
+
+    // a plain file reads back what's on disk, so once is enough
+    if (!nasty())
+        return read && memcmp(disk.data(), data, len) == 0;
+
+    size_t half = (len + 1) / 2;
+    read = readAt(offset, halves.data(), half) && read;
+    read = readAt(offset + half, halves.data() + half, len - half) && read;
+
+    for (size_t start = 0; start < len; start += VERIFY_CHUNK)
+    {
+        size_t n = min(VERIFY_CHUNK, len - start);
+        if (read && memcmp(disk.data() + start, data + start, n) == 0 && memcmp(halves.data() + start, data + start, n) == 0)
+            continue;
+
+        bool rewrite = true;
+        do
+        {
+            if (rewrite && !writeAt(offset + start, data + start, n))
+            {
+                cerr << "Error writing output file " << fileName << " errno=" << strerror(errno) << endl;
+                return false;
+            }
+        } while (!readsBack(offset + start, data + start, n, rewrite));
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     readsBack
+//
+//    true if the n bytes at offset, no more than VERIFY_CHUNK, read
+//    back as data whole and in halves. A whole read that's wrong
+//    sets rewrite, so they're written again. If only the halves are
+//    wrong, the read is the likelier culprit, so the next whole read
+//    settles it without a rewrite.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool FileWriter::readsBack(size_t offset, const char *data, size_t n, bool &rewrite)
+{
+    char chunk[VERIFY_CHUNK];
+    size_t half = (n + 1) / 2;
+    rewrite = !readAt(offset, chunk, n) || memcmp(chunk, data, n) != 0;
+    if (rewrite)
+        return false;
+    return readAt(offset, chunk, half) && readAt(offset + half, chunk + half, n - half) && memcmp(chunk, data, n) == 0;
+}
@@ -0,0 +1,42 @@
+//
+//        filewriter.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include "filehelper.h"
+#include "c150nastyfile.h"
+
+// Positioned reads and writes on the server's .tmp file, so incoming data
+// can go straight to disk instead of being held in memory.
+//
+// With file nastiness 0 this is pwrite/pread on a plain descriptor, and verify
+// reads back once to catch a write that didn't land, like one past a full
+// disk. Otherwise it goes through NASTYFILE, and verify reads back what was
+// written twice over, fixing it a VERIFY_CHUNK at a time.
+class FileWriter
+{
+private:
+    string fileName;
+    size_t fileSize;
+    int fd = -1;
+    NASTYFILE *outputFile = nullptr;
+    vector<char> disk;   // what verify read back whole
+    vector<char> halves; // and in two halves
+
+    bool readsBack(size_t offset, const char *data, size_t n, bool &rewrite);
+
+public:
+    FileWriter(string fileName, size_t fileSize, int nastiness, bool keep = false);
+    ~FileWriter();
+
+    bool nasty();
+    bool writeAt(size_t offset, const char *data, size_t len);
+    bool readAt(size_t offset, char *dest, size_t len);
+    bool verify(size_t offset, const char *data, size_t len);
+};
+
+#endif
@@ -0,0 +1,203 @@
+//
+//        journal.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "journal.h"
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     fromHex
+//
+//        len bytes from exactly 2 * len hex digits. false if
+//        hex isn't that.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static bool fromHex(const string &hex, unsigned char *bytes, size_t len)
+{
+    if (hex.size() != len * 2)
+        return false;
+    for (size_t i = 0; i < len; i++)
+    {
+        char *end;
+        string byte = hex.substr(i * 2, 2);
+        bytes[i] = strtoul(byte.c_str(), &end, 16);
+        if (*end != '\0')
+            return false;
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     Journal
+//
+//    reads the journal at path if it is for this transfer, and writes
+//    back only the lines that parsed, so a line cut off by a crash
+//    can't run into the next one. Otherwise starts a new one.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+Journal::Journal(string path, size_t size, unsigned int payload, unsigned char digest, const unsigned char hash[20], unsigned int ttlBlocks)
+    : path(path), verified(ttlBlocks, false), hashes(ttlBlocks)
+{
+    ostringstream first;
+    first << "file " << getHexRepresentation(hash, 20) << " " << size << " " << payload << " " << (int)digest;
+    header = first.str();
+
+    ifstream in(path.c_str());
+    string line;
+    if (!getline(in, line) || line != header)
+    {
+        in.close();
+        start();
+        return;
+    }
+
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        string kind, hex;
+        unsigned int n;
+        if (!(fields >> kind >> n >> hex))
+            continue;
+
+        if (kind == "block" && n < ttlBlocks && fromHex(hex, hashes[n].obuf, 20))
+            verified[n] = true;
+        else if (kind == "hash" && n <= ttlBlocks && fromHex(hex, reinterpret_cast<unsigned char *>(&ctx), sizeof(ctx)))
+            hashedBlocks = n;
+    }
+    in.close();
+
+    while (prefix < ttlBlocks && verified[prefix])
+        prefix++;
+    // saved hashes never cover more than the prefix, but a bad journal could say so
+    if (hashedBlocks > prefix)
+        hashedBlocks = 0;
+    loaded = true;
+
+    string tmpName = path + ".tmp";
+    ofstream rewrite(tmpName.c_str(), ios::trunc);
+    rewrite << header << "\n";
+    for (unsigned int b = 0; b < ttlBlocks; b++)
+    {
+        if (verified[b])
+            rewrite << "block " << b << " " << getHexRepresentation(hashes[b].obuf, 20) << "\n";
+    }
+    if (hashedBlocks > 0)
+        rewrite << "hash " << hashedBlocks << " " << getHexRepresentation(reinterpret_cast<unsigned char *>(&ctx), sizeof(ctx)) << "\n";
+    rewrite.close();
+    if (!rewrite || rename(tmpName.c_str(), path.c_str()) != 0)
+        cerr << "Error writing journal " << path << " errno=" << strerror(errno) << endl;
+
+    out.open(path.c_str(), ios::app);
+}
+
+// writes a journal with nothing in it but the header
+void Journal::start()
+{
+    if (out.is_open())
+        out.close();
+    out.open(path.c_str(), ios::trunc);
+    out << header << "\n" << flush;
+    if (!out)
+        cerr << "Error writing journal " << path << " errno=" << strerror(errno) << endl;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     resumed / isVerified / blockHash /
+//                     verifiedPrefix / savedHash
+//
+//    what the journal knew when it was opened, and has learned
+//    since. savedHash returns how many blocks the saved running
+//    hash covers, 0 if there isn't one.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool Journal::resumed()
+{
+    return loaded && prefix > 0;
+}
+
+bool Journal::isVerified(unsigned int block)
+{
+    return verified[block];
+}
+
+const Hash &Journal::blockHash(unsigned int block)
+{
+    return hashes[block];
+}
+
+unsigned int Journal::verifiedPrefix()
+{
+    return prefix;
+}
+
+unsigned int Journal::savedHash(TreeHash &saved)
+{
+    if (hashedBlocks > 0)
+        saved = ctx;
+    return hashedBlocks;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     record / recordHash
+//
+//    notes a block the client's check agreed with, and the running
+//    hash once it is JOURNAL_HASH_BLOCKS past the last one saved.
+//    The hash is only saved over verified blocks, so a resumed
+//    file can trust it as far as it goes.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void Journal::record(unsigned int block, const Hash &hash)
+{
+    if (verified[block])
+        return;
+    verified[block] = true;
+    hashes[block] = hash;
+    while (prefix < verified.size() && verified[prefix])
+        prefix++;
+
+    out << "block " << block << " " << getHexRepresentation(hash.obuf, 20) << "\n" << flush;
+}
+
+void Journal::recordHash(unsigned int blocks, const TreeHash &running)
+{
+    if (blocks > prefix || blocks < hashedBlocks + JOURNAL_HASH_BLOCKS)
+        return;
+    hashedBlocks = blocks;
+    ctx = running;
+
+    out << "hash " << blocks << " " << getHexRepresentation(reinterpret_cast<const unsigned char *>(&ctx), sizeof(ctx)) << "\n" << flush;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     clear / remove
+//
+//    forget every block, after a failed file check says one of
+//    them is wrong after all; or delete the journal once the file
+//    is complete.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void Journal::clear()
+{
+    verified.assign(verified.size(), false);
+    prefix = 0;
+    hashedBlocks = 0;
+    loaded = false;
+    start();
+}
+
+void Journal::remove()
+{
+    out.close();
+    ::remove(path.c_str());
+}
@@ -0,0 +1,60 @@
+//
+//        journal.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "filehelper.h"
+
+// Added to a file's name for its journal, next to its .tmp file.
+const string JOURNAL_SUFFIX = ".journal";
+
+// Blocks the running file hash goes past before it is saved again.
+// A resumed file rereads at most this many blocks to catch up.
+const unsigned int JOURNAL_HASH_BLOCKS = 256;
+
+// What the server has done with one .tmp file, on disk, so a transfer cut
+// short by a crash can carry on where it left off instead of from the start.
+//
+// The first line names the transfer: "file <hash hex> <size> <payload>
+// <digest>". After it, "block <n> <digest hex>" says the client's 'e' check
+// of block n matched ours, and "hash <n> <TreeHash hex>" saves the running
+// file hash once it covers the first n blocks. Lines are only ever added,
+// and each is flushed as it's written, so a crash loses at most the last.
+//
+// A journal for a different transfer, or one that doesn't parse, is thrown
+// away and started over.
+class Journal
+{
+private:
+    string path;
+    string header;
+    ofstream out;
+    vector<bool> verified;
+    vector<Hash> hashes;
+    unsigned int prefix = 0; // blocks from the start that are all verified
+    TreeHash ctx;
+    unsigned int hashedBlocks = 0;
+    bool loaded = false;
+
+    void start();
+
+public:
+    Journal(string path, size_t size, unsigned int payload, unsigned char digest, const unsigned char hash[20], unsigned int ttlBlocks);
+
+    bool resumed();
+    bool isVerified(unsigned int block);
+    const Hash &blockHash(unsigned int block);
+    unsigned int verifiedPrefix();
+    unsigned int savedHash(TreeHash &saved);
+
+    void record(unsigned int block, const Hash &hash);
+    void recordHash(unsigned int blocks, const TreeHash &running);
+    void clear();
+    void remove();
+};
+
+#endif
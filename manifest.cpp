@@ -0,0 +1,132 @@
+//
+//        manifest.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "manifest.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     Manifest
+//
+//    reads whatever manifest dir has, and writes it back with only
+//    the latest line for each name. A line that doesn't parse is
+//    dropped; that file just gets sent again.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+Manifest::Manifest(string dir)
+    : dir(dir), path(makeFileName(dir, MANIFEST_NAME))
+{
+    ifstream in(path.c_str());
+    string line;
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        string hex;
+        ManifestEntry entry;
+        if (!(fields >> hex >> entry.size >> entry.mtimeSec >> entry.mtimeNsec) || hex.size() != 40)
+            continue;
+
+        bool ok = true;
+        for (int i = 0; i < 20 && ok; i++)
+        {
+            char *end;
+            string byte = hex.substr(i * 2, 2);
+            entry.hash[i] = strtoul(byte.c_str(), &end, 16);
+            ok = *end == '\0';
+        }
+
+        string name;
+        fields.get();
+        getline(fields, name);
+        if (ok && !name.empty())
+            entries[name] = entry;
+    }
+    in.close();
+
+    string tmpName = path + ".tmp";
+    ofstream out(tmpName.c_str(), ios::trunc);
+    for (map<string, ManifestEntry>::iterator it = entries.begin(); it != entries.end(); it++)
+        write(out, it->first, it->second);
+    out.close();
+    if (!out || rename(tmpName.c_str(), path.c_str()) != 0)
+        cerr << "Error writing manifest " << path << " errno=" << strerror(errno) << endl;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     identical
+//
+//    true if the file in the target directory is the one we last
+//    received under name, untouched since, and has this size and hash.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool Manifest::identical(const string &name, size_t size, const unsigned char hash[20])
+{
+    lock_guard<mutex> guard(lock);
+    map<string, ManifestEntry>::iterator it = entries.find(name);
+    ManifestEntry current;
+    if (it == entries.end() || !stat(name, current))
+        return false;
+
+    const ManifestEntry &known = it->second;
+    return current.size == known.size && current.mtimeSec == known.mtimeSec && current.mtimeNsec == known.mtimeNsec &&
+           known.size == size && memcmp(known.hash, hash, 20) == 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     record
+//
+//        notes a file that just arrived intact, with its hash.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void Manifest::record(const string &name, const unsigned char hash[20])
+{
+    lock_guard<mutex> guard(lock);
+    ManifestEntry entry;
+    if (!stat(name, entry))
+        return;
+    memcpy(entry.hash, hash, 20);
+    entries[name] = entry;
+
+    ofstream out(path.c_str(), ios::app);
+    write(out, name, entry);
+    out.close();
+    if (!out)
+        cerr << "Error writing manifest " << path << " errno=" << strerror(errno) << endl;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     stat / write
+//
+//    the size and mtime of a file in the target directory, false if
+//    it isn't a regular file there; and one line of the manifest.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool Manifest::stat(const string &name, ManifestEntry &entry)
+{
+    struct stat statbuf;
+    if (lstat(makeFileName(dir, name).c_str(), &statbuf) != 0 || !S_ISREG(statbuf.st_mode))
+        return false;
+
+    entry.size = statbuf.st_size;
+    entry.mtimeSec = statbuf.st_mtim.tv_sec;
+    entry.mtimeNsec = statbuf.st_mtim.tv_nsec;
+    return true;
+}
+
+void Manifest::write(ostream &out, const string &name, const ManifestEntry &entry)
+{
+    out << getHexRepresentation(entry.hash, 20) << " " << entry.size << " " << entry.mtimeSec << " "
+        << entry.mtimeNsec << " " << name << "\n";
+}
@@ -0,0 +1,53 @@
+//
+//        manifest.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "filehelper.h"
+#include <map>
+#include <mutex>
+
+// Name of the manifest in the target directory. The dot keeps it out of ls.
+const string MANIFEST_NAME = ".fileserver.manifest";
+
+// What the manifest knows about one file in the target directory.
+struct ManifestEntry
+{
+    size_t size;
+    long mtimeSec; // when we last wrote the file, so a change made behind our back shows
+    long mtimeNsec;
+    unsigned char hash[20]; // TreeHash of the whole file
+};
+
+// The server's record of every file it has received into the target
+// directory, kept there across runs, so a client starting a file we
+// already have can be told there's nothing to send.
+//
+// Each line is "<hash hex> <size> <mtime sec> <mtime nsec> <name>". New
+// lines are appended as files come in, and a later line for a name wins.
+// The file is rewritten without the old lines each time the server starts.
+//
+// Workers share one Manifest, so every method takes the lock.
+class Manifest
+{
+private:
+    string dir;
+    string path;
+    map<string, ManifestEntry> entries;
+    mutex lock;
+
+    bool stat(const string &name, ManifestEntry &entry);
+    void write(ostream &out, const string &name, const ManifestEntry &entry);
+
+public:
+    Manifest(string dir);
+
+    bool identical(const string &name, size_t size, const unsigned char hash[20]);
+    void record(const string &name, const unsigned char hash[20]);
+};
+
+#endif
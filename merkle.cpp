@@ -0,0 +1,173 @@
+//
+//        merkle.cpp
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#include "merkle.h"
+#include <cstring>
+
+using namespace C150NETWORK; // for all the comp150 utilities
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     leafDigests
+//
+//        digest of each payload sized packet in a block's bytes.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void leafDigests(const char *data, size_t bytes, unsigned int payload, vector<unsigned int> &leaves)
+{
+    leaves.clear();
+    for (size_t offset = 0; offset < bytes; offset += payload)
+        leaves.push_back(crc32c(data + offset, min(size_t(payload), bytes - offset)));
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     merkleNode
+//
+//    digest of node (level, index) of the tree over the count digests
+//    in base, where level counts up from base. The node must not be empty.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int merkleNode(const unsigned int *base, size_t count, unsigned int level, size_t index)
+{
+    if (level == 0)
+        return base[index];
+
+    unsigned int left = merkleNode(base, count, level - 1, index * 2);
+    if (((index * 2 + 1) << (level - 1)) >= count)
+        return left;
+
+    unsigned int children[2] = {left, merkleNode(base, count, level - 1, index * 2 + 1)};
+    return crc32c(reinterpret_cast<const char *>(children), sizeof(children));
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     merkleRootLevel
+//
+//        level of the root of the tree for a file of this many blocks.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int merkleRootLevel(size_t blocks)
+{
+    unsigned int level = MERKLE_BLOCK_LEVEL;
+    while ((size_t(1) << (level - MERKLE_BLOCK_LEVEL)) < blocks)
+        level++;
+    return level;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     MerkleSearch
+//
+//    starts the search at (rootLevel, rootIndex), which we already know
+//    is wrong. If that's at baseLevel, there's nothing left to ask.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+MerkleSearch::MerkleSearch(unsigned int fileId, const vector<unsigned int> &base, unsigned int baseLevel,
+                           unsigned int baseFirst, unsigned int rootLevel, unsigned int rootIndex)
+    : fileId(fileId), base(base), baseLevel(baseLevel), baseFirst(baseFirst)
+{
+    if (rootLevel == baseLevel)
+        found.push_back(rootIndex - baseFirst);
+    else
+        expand(rootLevel, rootIndex);
+}
+
+bool MerkleSearch::done()
+{
+    return pending.empty();
+}
+
+// indices into base of the nodes at baseLevel that differ from the server's
+const vector<unsigned int> &MerkleSearch::mismatched()
+{
+    return found;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     ours / expand
+//
+//    our digest of a node, and queueing a query for a node's children.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned int MerkleSearch::ours(unsigned int level, unsigned int index)
+{
+    unsigned int local = index - (baseFirst >> (level - baseLevel));
+    return merkleNode(base.data(), base.size(), level - baseLevel, local);
+}
+
+void MerkleSearch::expand(unsigned int level, unsigned int index)
+{
+    MerkleQuery query;
+    query.level = level - 1;
+    query.first = index * 2;
+
+    // the right child is left out when it's empty
+    unsigned int right = query.first + 1 - (baseFirst >> (query.level - baseLevel));
+    query.count = (size_t(right) << (query.level - baseLevel)) < base.size() ? 2 : 1;
+    pending.push_back(query); // sentAt starts at the epoch, so it goes out on the next pump
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     pump
+//
+//        sends queries that are new or whose response is overdue.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void MerkleSearch::pump(C150NastyDgmSocket *sock, WriteHelper *helper, Clock::duration rto)
+{
+    Clock::time_point now = Clock::now();
+    for (unsigned int i = 0; i < pending.size(); i++)
+    {
+        if (now - pending[i].sentAt < rto)
+            continue;
+
+        MerklePacket pckt;
+        pckt.cmd = 'm';
+        pckt.fileId = fileId;
+        pckt.level = pending[i].level;
+        pckt.first = pending[i].first;
+        pckt.count = pending[i].count;
+        helper->sendMsg(sock, pckt);
+        pending[i].sentAt = now;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     handle
+//
+//    compares the server's digests to ours, going further down under
+//    each one that differs. false if the response isn't for this search.
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool MerkleSearch::handle(const MerkleResponsePacket &response)
+{
+    for (unsigned int i = 0; i < pending.size(); i++)
+    {
+        MerkleQuery query = pending[i];
+        if (response.fileId != fileId || response.level != query.level || response.first != query.first ||
+            response.count != query.count)
+            continue;
+
+        pending.erase(pending.begin() + i);
+        for (unsigned int k = 0; k < query.count; k++)
+        {
+            unsigned int index = query.first + k;
+            if (response.digests[k] == ours(query.level, index))
+                continue;
+            if (query.level == baseLevel)
+                found.push_back(index - baseFirst);
+            else
+                expand(query.level, index);
+        }
+        return true;
+    }
+    return false;
+}
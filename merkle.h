@@ -0,0 +1,66 @@
+//
+//        merkle.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "filehelper.h"
+
+// A file's Merkle tree is a binary tree over its packets. Every block gets
+// 2^MERKLE_BLOCK_LEVEL leaf slots, so the nodes at that level are exactly
+// the blocks; slots past a block's last packet are empty. Node (level, i)
+// covers slots i << level through ((i + 1) << level) - 1.
+//
+// A leaf is the CRC-32C of its packet's bytes. A node is the CRC-32C of its
+// two children's digests, or just its left child's when the right is empty.
+// These only find where two copies differ; the 'f' check still decides if
+// they match.
+const unsigned int MERKLE_BLOCK_LEVEL = 8;
+const unsigned int MERKLE_BLOCK_SLOTS = 1 << MERKLE_BLOCK_LEVEL;
+
+static_assert(CHECK_SIZE <= MERKLE_BLOCK_SLOTS, "a block's packets must fit in its leaf slots");
+
+void leafDigests(const char *data, size_t bytes, unsigned int payload, vector<unsigned int> &leaves);
+unsigned int merkleNode(const unsigned int *base, size_t count, unsigned int level, size_t index);
+unsigned int merkleRootLevel(size_t blocks);
+
+// One 'm' query waiting for its response.
+struct MerkleQuery
+{
+    unsigned int level;
+    unsigned int first;
+    unsigned int count;
+    Clock::time_point sentAt;
+};
+
+// Walks down a file's Merkle tree from one node, asking the server for the
+// children of every node whose digest differs from ours, until it reaches
+// baseLevel. Our side of the tree is built from our digests at baseLevel:
+// the leaves of one block, or the block roots of the whole file.
+class MerkleSearch
+{
+private:
+    unsigned int fileId;
+    vector<unsigned int> base;
+    unsigned int baseLevel;
+    unsigned int baseFirst; // index at baseLevel of base[0]
+    vector<MerkleQuery> pending;
+    vector<unsigned int> found;
+
+    unsigned int ours(unsigned int level, unsigned int index);
+    void expand(unsigned int level, unsigned int index);
+
+public:
+    MerkleSearch(unsigned int fileId, const vector<unsigned int> &base, unsigned int baseLevel,
+                 unsigned int baseFirst, unsigned int rootLevel, unsigned int rootIndex);
+
+    bool done();
+    const vector<unsigned int> &mismatched();
+    void pump(C150NastyDgmSocket *sock, WriteHelper *helper, Clock::duration rto);
+    bool handle(const MerkleResponsePacket &response);
+};
+
+#endif
@@ -0,0 +1,56 @@
+//
+//        spscqueue.h
+//
+//     Author: Matt Langley (mlangl02) and Caleb Pekowsky (cpekow01)
+//
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+// Fixed size, lock-free queue for exactly one producer thread and one
+// consumer thread. Items are filled and read in place: the producer fills
+// back() and then calls push(), the consumer reads front() and then pop().
+template <typename T, size_t N>
+class SpscQueue
+{
+private:
+    T items[N];
+    alignas(64) std::atomic<size_t> head{0}; // next item to read, only the consumer moves it
+    alignas(64) std::atomic<size_t> tail{0}; // next item to fill, only the producer moves it
+
+public:
+    // producer: slot to fill, or nullptr if the queue is full
+    T *back()
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return nullptr;
+        return &items[t % N];
+    }
+
+    // producer: hands the slot from back() to the consumer
+    void push()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer: oldest item, or nullptr if the queue is empty
+    T *front()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return nullptr;
+        return &items[h % N];
+    }
+
+    // consumer: gives the slot from front() back to the producer
+    void pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+#endif